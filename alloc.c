@@ -1,3 +1,6 @@
+// needed for mremap.
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -7,6 +10,16 @@
 #include <string.h>
 #include <assert.h>
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
 
 // Simple container_of implementation to get the containing structure
 // from a pointer to a struct's field.
@@ -24,15 +37,20 @@ typedef struct Allocator Allocator;
 typedef void* (*AllocatorAlloc)(Allocator *allocator, size_t size);
 typedef void (*AllocatorFree)(Allocator *allocator, void *ptr);
 typedef void* (*AllocatorRealloc)(Allocator *allocator, void *old_ptr, size_t new_size);
+typedef size_t (*AllocatorGoodSize)(Allocator *allocator, size_t size);
 
 // The allocator has functions for allocation, free, and reallocation. Calloc is not
 // included for simplicity.
 // Some allocator interfaces would also require a size to be provide to free, which can
 // be helpful to the implementation.
+// The good_size function tells how many bytes the allocator would really set aside for
+// an allocation of the given size, after any rounding it does. A growable container can
+// ask for that much and use all of it, rather then leaving the rounding unused.
 typedef struct Allocator {
     AllocatorAlloc alloc;
     AllocatorFree free;
     AllocatorRealloc realloc;
+    AllocatorGoodSize good_size;
 } Allocator;
 
 // The heap allocator just wraps the system allocator in the Allocator trait.
@@ -40,6 +58,48 @@ typedef struct HeapAllocator {
     Allocator allocator;
 } HeapAllocator;
 
+// The Large allocator maps large allocations directly from the operating system, and
+// passes smaller allocations on to a backing allocator. Growing a large allocation is
+// done with mremap, which moves the pages of the mapping around rather then copying
+// their contents, so growing a very large buffer costs about the same as mapping it.
+// Each allocation has a small header in front of it recording how it was allocated.
+typedef struct LargeAllocator {
+    Allocator allocator;
+    Allocator *backing_allocator;
+    // allocations of at least this many bytes are mapped directly.
+    size_t threshold;
+} LargeAllocator;
+
+// The header placed in front of every LargeAllocator allocation. It is 16 bytes so
+// the user's pointer keeps the alignment of the underlying memory.
+typedef struct LargeHeader {
+    // the length of the mapping, including this header, or 0 if the memory came from
+    // the backing allocator.
+    size_t mapped;
+    size_t size;
+} LargeHeader;
+
+typedef struct ArenaAllocator ArenaAllocator;
+typedef struct ArenaPurger ArenaPurger;
+typedef struct ArenaBlock ArenaBlock;
+
+// Every block of memory an arena gets from its backing allocator starts with this header,
+// which records the block's usable length and links it into a list of blocks.
+typedef struct ArenaBlock {
+    ArenaBlock *next;
+    size_t length;
+} ArenaBlock;
+
+// An arena registered with an ArenaPurger moves between these states. The owning
+// thread marks the arena idle when it is cleared and active again on the next
+// allocation, and the purger only touches the arena's memory while it holds it
+// in the purging state.
+typedef enum ArenaState {
+    ARENA_ACTIVE,
+    ARENA_IDLE,
+    ARENA_PURGING,
+} ArenaState;
+
 // The Arena allocator wraps another allocator, providing a simple stack of allocations
 // that grow a memory area as more memory is allocated. There are much better and most
 // sophisticated arena allocation strategies out there.
@@ -54,8 +114,75 @@ typedef struct ArenaAllocator {
     uint8_t *memory;
     size_t count;
     size_t length;
+
+    // The purger fields are only used if the arena is registered with an ArenaPurger.
+    ArenaPurger *purger;
+    ArenaAllocator *purge_next;
+    atomic_int state;
+    // time of the last clear, in nanoseconds of the monotonic clock.
+    uint64_t idle_since;
+    // number of bytes at the front of memory that may be backed by physical pages.
+    size_t dirty;
+
+    // blocks the arena has grown out of. Allocations in them may still be in use, so they
+    // are kept until the arena is cleared or destroyed.
+    ArenaBlock *retired;
+
+    // Arenas form a tree of regions. A child arena gets its blocks from its parent's
+    // block_allocator, and gives them back to the parent's free_blocks cache when it is
+    // cleared or destroyed, so short lived children don't go back to the root's backing
+    // allocator for memory. Destroying an arena destroys its children first.
+    ArenaAllocator *parent;
+    ArenaAllocator *children;
+    ArenaAllocator *sibling;
+    Allocator block_allocator;
+    ArenaBlock *free_blocks;
 } ArenaAllocator;
 
+// The ArenaPurger gives the physical memory of idle arenas back to the operating
+// system. An arena which was cleared and has not been used for decay nanoseconds
+// has its unused pages (past the first retain bytes) released with madvise. The
+// virtual memory stays with the arena, so the next allocation does not have to go
+// through the backing allocator again- it just faults fresh pages back in.
+// The purger can be driven by calling arena_purger_tick, or by starting a
+// background thread that ticks at a fixed interval.
+typedef struct ArenaPurger {
+    pthread_mutex_t lock;
+    // intrusive list of registered arenas, linked through purge_next.
+    ArenaAllocator *arenas;
+    uint64_t decay;
+    size_t retain;
+    // MADV_DONTNEED drops pages immediately, MADV_FREE lets the kernel take them lazily.
+    int advice;
+    // total bytes given back to the system.
+    atomic_size_t purged;
+
+    pthread_t thread;
+    atomic_bool running;
+    uint64_t interval;
+} ArenaPurger;
+
+// The number of past generations an AdaptiveArena remembers.
+#define ADAPTIVE_ARENA_HISTORY 16
+
+// The AdaptiveArena is an arena that is reset once per unit of work (such as a request),
+// and which learns how much memory a unit of work usually needs. The peak usage of each
+// generation is recorded when the arena is reset, and the next generation starts with a
+// block sized to a high percentile of the recent peaks. This way a typical generation
+// never takes the growth path in arena_allocator_alloc, rather then starting small and
+// repeating the same sequence of growths every time.
+typedef struct AdaptiveArena {
+    ArenaAllocator arena;
+    // ring buffer of the peak usage of recent generations.
+    size_t peaks[ADAPTIVE_ARENA_HISTORY];
+    // total number of generations seen.
+    uint32_t generations;
+    // the percentile of the recent peaks to size the arena for, from 1 to 100.
+    uint32_t percentile;
+    // the block size the arena has learned, exposed for monitoring.
+    size_t learned;
+} AdaptiveArena;
+
 // The Bump allocator is a trivial allocator which just allows allocations within
 // an existing block of memory. The users managers the memory- allocating it statically
 // or dynamically. The Bump allocator just gives back pointers within the given block,
@@ -72,20 +199,288 @@ typedef struct BumpAllocator {
     size_t length;
 } BumpAllocator;
 
+// The number of size classes cached by the PerCpuAllocator, from 16 bytes up to 4KB
+// in powers of two. Larger allocations go directly to the backing allocator.
+#define PER_CPU_CLASSES 9
+// The maximum number of free blocks a shard keeps for each size class.
+#define PER_CPU_CACHE_LENGTH 64
+
+typedef struct PerCpuBlock PerCpuBlock;
+typedef struct PerCpuBlock {
+    PerCpuBlock *next;
+} PerCpuBlock;
+
+// A PerCpuShard holds the free blocks cached for one CPU. Shards are padded to a cache
+// line so that CPUs do not contend on each other's shards.
+typedef struct PerCpuShard {
+    _Alignas(64) atomic_flag lock;
+    PerCpuBlock *free[PER_CPU_CLASSES];
+    uint32_t count[PER_CPU_CLASSES];
+} PerCpuShard;
+
+// The header placed in front of every PerCpuAllocator allocation, recording its size class
+// (or PER_CPU_CLASSES if it was not cached) and the size that was asked for.
+typedef struct PerCpuHeader {
+    size_t size_class;
+    size_t size;
+} PerCpuHeader;
+
+// The PerCpuAllocator caches freed blocks per CPU rather then per thread. A thread picks
+// the shard of the CPU it is running on with sched_getcpu, so any number of threads share
+// a fixed number of caches, and the memory held in the caches is bounded by the number of
+// CPUs rather then growing with the number of threads.
+// Each shard has a lock, which is almost never contended- only a thread which migrates
+// between looking up its CPU and using the shard can find another thread in there.
+// If the shards can't be allocated there are no caches, and every allocation goes straight
+// to the backing allocator.
+typedef struct PerCpuAllocator {
+    Allocator allocator;
+    Allocator *backing_allocator;
+    PerCpuShard *shards;
+    uint32_t num_shards;
+    // the backing allocator does not align to a cache line, so the shards are placed
+    // inside a larger block, which is kept here to free it.
+    void *shard_memory;
+} PerCpuAllocator;
+
+// A retire list holds pointers freed during one epoch, which can't be given back to
+// the backing allocator until every reader that might have seen them is done.
+typedef struct EpochRetireList {
+    void **ptrs;
+    size_t count;
+    size_t length;
+    // the global epoch the pointers were retired in.
+    uint64_t epoch;
+} EpochRetireList;
+
+typedef struct EpochThread EpochThread;
+
+// Each thread using an EpochAllocator has a record, which lives in a list owned by the
+// allocator. Records are never unlinked- a record whose thread has exited is marked as
+// not in use, and is picked up again by the next thread that registers, along with any
+// pointers it still has waiting to be freed.
+typedef struct EpochThread {
+    EpochThread *next;
+    atomic_bool in_use;
+    // whether the thread is inside a read-side critical section.
+    atomic_bool active;
+    // the global epoch the thread observed when entering its critical section.
+    atomic_uint_fast64_t epoch;
+    // nesting depth of epoch_allocator_enter calls, only touched by the owner.
+    uint32_t depth;
+    // pointers are retired into the list for their epoch modulo 3.
+    EpochRetireList retired[3];
+} EpochThread;
+
+// The EpochAllocator provides epoch-based reclamation on top of another allocator, for
+// building lock-free data structures. Readers wrap their accesses in epoch_allocator_enter
+// and epoch_allocator_exit. Freeing a pointer through the allocator only retires it, and
+// the pointer is passed on to the backing allocator once the global epoch has advanced
+// twice, at which point no reader can still be holding it.
+// Reads cost two stores and a load to enter and leave a critical section, rather then a
+// hazard pointer published for every pointer that is read.
+typedef struct EpochAllocator {
+    Allocator allocator;
+    Allocator *backing_allocator;
+    atomic_uint_fast64_t epoch;
+    _Atomic(EpochThread*) threads;
+    // looks up the calling thread's record.
+    pthread_key_t key;
+} EpochAllocator;
+
+// The number of retired pointers a thread collects before trying to free a batch.
+#define EPOCH_RETIRE_BATCH 64
+
+// The SnapshotArena is a fixed capacity arena whose memory is a memfd, so that its
+// contents can be snapshotted without copying them. Taking a snapshot freezes the file:
+// the snapshot maps it read-only, and the arena maps the same file copy-on-write at the
+// same address, so the arena's pointers stay valid and each page is only copied when the
+// arena first writes to it after the snapshot. Restoring a snapshot maps its file back
+// over the arena, throwing away everything written since.
+// While the arena's file is frozen by a snapshot, a new snapshot has to write the arena
+// out to a new memfd, as Linux has no way to share pages between two files. The snapshots
+// of a file share a count of themselves, and releasing the last snapshot of the arena's
+// file writes the arena back to it and maps it shared again.
+typedef struct SnapshotArena {
+    Allocator allocator;
+    // the file the arena is mapped from.
+    int fd;
+    uint8_t *memory;
+    size_t count;
+    size_t length;
+    // whether the arena is mapped copy-on-write, as a snapshot refers to fd.
+    bool frozen;
+    // the count of snapshots of fd, or NULL if there are none.
+    uint32_t *refs;
+} SnapshotArena;
+
+// A read-only view of a SnapshotArena at the time the snapshot was taken. The view is
+// mapped at a different address then the arena, so pointers into the arena must be
+// translated with arena_snapshot_ptr.
+typedef struct ArenaSnapshot {
+    int fd;
+    const uint8_t *memory;
+    size_t count;
+    size_t length;
+    // the count of snapshots of fd, shared between them.
+    uint32_t *refs;
+} ArenaSnapshot;
+
+// The StackPool hands out fixed-size execution stacks for coroutines and fibers. Each stack
+// is its own mapping with guard pages below it, so overflowing the stack faults rather
+// then scribbling over other memory. Released stacks are kept in the pool and handed out
+// again, as mapping and protecting a fresh stack is expensive compared to a context
+// switch. Stacks can be committed lazily, as they are touched, or up front.
+// The pool can be used through the Allocator trait, where every allocation is a stack
+// (and can be no larger then one), or through stack_pool_acquire and stack_pool_release.
+typedef struct StackPool {
+    Allocator allocator;
+    // usable size of each stack, rounded up to whole pages.
+    size_t stack_size;
+    // size of the guard region below each stack.
+    size_t guard_size;
+    // whether to leave the stack's pages to be committed as they are touched.
+    bool lazy;
+    // released stacks, linked through their first word.
+    void *free_stacks;
+    size_t free_count;
+    // the most stacks the pool keeps around. Stacks released beyond this are unmapped.
+    size_t max_free;
+} StackPool;
+
+// Allocator statistics can be published in a shared memory file, which other processes
+// can map and read at any time without the process doing anything for them- see
+// stats_reader.c. The layout of the file is a StatsHeader followed by an array of
+// StatsSlots, and stats_reader.c has its own copy of these definitions which must match.
+#define STATS_MAGIC 0x53544154u
+#define STATS_VERSION 1
+#define STATS_NAME_LENGTH 32
+
+// The counters for one allocator. Counters are only ever written by the process that owns
+// the file, with relaxed atomics so a reader never sees a torn value.
+typedef struct StatsSlot {
+    char name[STATS_NAME_LENGTH];
+    atomic_uint_least64_t alloc_calls;
+    atomic_uint_least64_t free_calls;
+    atomic_uint_least64_t realloc_calls;
+    atomic_uint_least64_t bytes_in_use;
+    atomic_uint_least64_t peak_bytes;
+    // the count and length of an arena, if one has been sampled into this slot.
+    atomic_uint_least64_t arena_count;
+    atomic_uint_least64_t arena_length;
+    uint64_t reserved;
+} StatsSlot;
+
+typedef struct StatsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    // slots below this index have a name and are in use.
+    atomic_uint used_slots;
+    uint64_t pid;
+} StatsHeader;
+
+// A shared memory file of allocator statistics, owned by this process.
+typedef struct StatsRegion {
+    StatsHeader *header;
+    StatsSlot *slots;
+    size_t length;
+    char path[256];
+} StatsRegion;
+
+// The StatsAllocator wraps another allocator, counting its calls and the bytes it has
+// handed out into a StatsSlot. Like the LargeAllocator, it puts a small header in front of
+// each allocation to remember its size.
+typedef struct StatsAllocator {
+    Allocator allocator;
+    Allocator *backing_allocator;
+    StatsSlot *slot;
+} StatsAllocator;
+
+// The deepest call stack recorded for an allocation sample.
+#define SAMPLE_MAX_DEPTH 32
+
+// An allocation site, identified by its call stack, and the allocations sampled there.
+typedef struct SampleSite {
+    uint64_t hash;
+    uint32_t depth;
+    void *frames[SAMPLE_MAX_DEPTH];
+    // the number of samples taken here.
+    uint64_t samples;
+    // an estimate of the total bytes allocated here.
+    uint64_t bytes;
+} SampleSite;
+
+// The SamplingAllocator wraps another allocator, taking a backtrace for about one in every
+// sample_rate bytes allocated and adding it to a table of allocation sites. Each sample
+// stands for sample_rate bytes, so the table estimates how many bytes were allocated from
+// each site, while only paying for a backtrace now and then. The distance to the next
+// sample is randomized, so allocation patterns that repeat can't line up with it.
+// The table can be written out in the folded stack format used by flame graph tools.
+// Function names are only available if the program is linked with -rdynamic.
+// Threads share the countdown to the next sample, which costs one atomic add per
+// allocation. Only the allocation that reaches the sample takes the lock on the table,
+// and it sets the next sample before taking the lock, so the countdown keeps counting
+// while a backtrace is taken.
+typedef struct SamplingAllocator {
+    Allocator allocator;
+    Allocator *backing_allocator;
+    size_t sample_rate;
+    // bytes left to allocate before the next sample.
+    atomic_int_least64_t bytes_until_sample;
+    // guards the table.
+    pthread_mutex_t lock;
+    atomic_uint_least64_t random_state;
+    // open addressing hash table of sites, allocated from the backing allocator.
+    SampleSite *sites;
+    size_t num_sites;
+    size_t capacity;
+} SamplingAllocator;
+
 // HeapAllocator functions
 HeapAllocator heap_allocator_create(void);
 void *heap_allocator_alloc(Allocator *allocator, size_t size);
 void heap_allocator_free(Allocator *allocator, void *ptr);
 void *heap_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t heap_allocator_good_size(Allocator *allocator, size_t size);
+
+// LargeAllocator functions
+LargeAllocator large_allocator_create(Allocator *backing_allocator, size_t threshold);
+void *large_allocator_alloc(Allocator *allocator, size_t size);
+void large_allocator_free(Allocator *allocator, void *ptr);
+void *large_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t large_allocator_good_size(Allocator *allocator, size_t size);
 
 // ArenaAllocator functions
 ArenaAllocator arena_allocator_create(Allocator *backing_allocator);
 void arena_allocator_destroy(ArenaAllocator *arena_allocator);
 void arena_allocator_clear(ArenaAllocator *arena_allocator);
+void arena_allocator_init_child(ArenaAllocator *parent, ArenaAllocator *child);
 
 void *arena_allocator_alloc(Allocator *allocator, size_t size);
 void arena_allocator_free(Allocator *allocator, void *ptr);
 void *arena_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t arena_allocator_good_size(Allocator *allocator, size_t size);
+
+void *arena_allocator_block_alloc(Allocator *allocator, size_t size);
+void arena_allocator_block_free(Allocator *allocator, void *ptr);
+void *arena_allocator_block_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t arena_allocator_block_good_size(Allocator *allocator, size_t size);
+
+// ArenaPurger functions
+ArenaPurger arena_purger_create(uint64_t decay_ms, size_t retain, bool lazy);
+void arena_purger_destroy(ArenaPurger *purger);
+void arena_purger_register(ArenaPurger *purger, ArenaAllocator *arena_allocator);
+void arena_purger_unregister(ArenaPurger *purger, ArenaAllocator *arena_allocator);
+size_t arena_purger_tick(ArenaPurger *purger);
+bool arena_purger_start(ArenaPurger *purger, uint64_t interval_ms);
+void arena_purger_stop(ArenaPurger *purger);
+
+// AdaptiveArena functions
+AdaptiveArena adaptive_arena_create(Allocator *backing_allocator, uint32_t percentile);
+void adaptive_arena_destroy(AdaptiveArena *adaptive_arena);
+void adaptive_arena_reset(AdaptiveArena *adaptive_arena);
+size_t adaptive_arena_learned_size(AdaptiveArena *adaptive_arena);
 
 // BumpAllocator functions
 BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory);
@@ -93,8 +488,184 @@ void bump_allocator_destroy(BumpAllocator *bump_allocator);
 void *bump_allocator_alloc(Allocator *allocator, size_t size);
 void bump_allocator_free(Allocator *allocator, void *ptr);
 void *bump_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t bump_allocator_good_size(Allocator *allocator, size_t size);
 void *bump_allocator_free_all(Allocator *allocator);
 
+// Define a BumpAllocator whose memory is a static buffer of the given capacity. The buffer
+// is zero initialized, so it lives in .bss and costs nothing until it is touched, and the
+// allocator is a constant initializer, so it is ready before main with no allocation at
+// all. The capacity must be a constant expression, and is checked at compile time.
+// For example, at file scope:
+//     BUMP_ALLOCATOR_STATIC(scratch_allocator, 64 * 1024);
+#define BUMP_ALLOCATOR_STATIC(name, capacity) \
+    _Static_assert((capacity) > 0, "a static bump allocator needs some memory"); \
+    static _Alignas(max_align_t) uint8_t name##_memory[(capacity)]; \
+    static BumpAllocator name = { { bump_allocator_alloc, bump_allocator_free, bump_allocator_realloc, bump_allocator_good_size }, name##_memory, 0, (capacity) }
+
+// PerCpuAllocator functions
+PerCpuAllocator per_cpu_allocator_create(Allocator *backing_allocator);
+void per_cpu_allocator_destroy(PerCpuAllocator *per_cpu_allocator);
+void *per_cpu_allocator_alloc(Allocator *allocator, size_t size);
+void per_cpu_allocator_free(Allocator *allocator, void *ptr);
+void *per_cpu_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t per_cpu_allocator_good_size(Allocator *allocator, size_t size);
+
+// EpochAllocator functions
+EpochAllocator epoch_allocator_create(Allocator *backing_allocator);
+void epoch_allocator_destroy(EpochAllocator *epoch_allocator);
+void epoch_allocator_enter(EpochAllocator *epoch_allocator);
+void epoch_allocator_exit(EpochAllocator *epoch_allocator);
+bool epoch_allocator_try_advance(EpochAllocator *epoch_allocator);
+size_t epoch_allocator_collect(EpochAllocator *epoch_allocator);
+size_t epoch_allocator_pending(EpochAllocator *epoch_allocator);
+void *epoch_allocator_alloc(Allocator *allocator, size_t size);
+void epoch_allocator_free(Allocator *allocator, void *ptr);
+void *epoch_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t epoch_allocator_good_size(Allocator *allocator, size_t size);
+
+// SnapshotArena functions
+SnapshotArena snapshot_arena_create(size_t capacity);
+void snapshot_arena_destroy(SnapshotArena *snapshot_arena);
+ArenaSnapshot snapshot_arena_snapshot(SnapshotArena *snapshot_arena);
+bool snapshot_arena_restore(SnapshotArena *snapshot_arena, ArenaSnapshot *snapshot);
+void *snapshot_arena_alloc(Allocator *allocator, size_t size);
+void snapshot_arena_free(Allocator *allocator, void *ptr);
+void *snapshot_arena_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t snapshot_arena_good_size(Allocator *allocator, size_t size);
+
+// ArenaSnapshot functions
+void arena_snapshot_release(ArenaSnapshot *snapshot, SnapshotArena *snapshot_arena);
+const void *arena_snapshot_ptr(ArenaSnapshot *snapshot, SnapshotArena *snapshot_arena, void *ptr);
+
+// StackPool functions
+StackPool stack_pool_create(size_t stack_size, size_t guard_pages, size_t max_free, bool lazy);
+void stack_pool_destroy(StackPool *stack_pool);
+void *stack_pool_acquire(StackPool *stack_pool);
+void stack_pool_release(StackPool *stack_pool, void *stack);
+void *stack_pool_alloc(Allocator *allocator, size_t size);
+void stack_pool_free(Allocator *allocator, void *ptr);
+void *stack_pool_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t stack_pool_good_size(Allocator *allocator, size_t size);
+
+// StatsRegion functions
+StatsRegion stats_region_create(const char *path, uint32_t num_slots);
+void stats_region_destroy(StatsRegion *stats_region);
+StatsSlot *stats_region_slot(StatsRegion *stats_region, const char *name);
+
+// StatsAllocator functions
+StatsAllocator stats_allocator_create(Allocator *backing_allocator, StatsSlot *slot);
+void stats_allocator_sample_arena(StatsSlot *slot, ArenaAllocator *arena_allocator);
+void *stats_allocator_alloc(Allocator *allocator, size_t size);
+void stats_allocator_free(Allocator *allocator, void *ptr);
+void *stats_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t stats_allocator_good_size(Allocator *allocator, size_t size);
+
+// SamplingAllocator functions
+SamplingAllocator sampling_allocator_create(Allocator *backing_allocator, size_t sample_rate);
+void sampling_allocator_destroy(SamplingAllocator *sampling_allocator);
+void sampling_allocator_dump_folded(SamplingAllocator *sampling_allocator, FILE *file);
+void *sampling_allocator_alloc(Allocator *allocator, size_t size);
+void sampling_allocator_free(Allocator *allocator, void *ptr);
+void *sampling_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t sampling_allocator_good_size(Allocator *allocator, size_t size);
+
+
+// Allocate and free blocks of a few sizes, checking that no one else scribbles on them.
+static void *per_cpu_allocator_test_thread(void *arg) {
+    Allocator *allocator = (Allocator*)arg;
+
+    for (int round = 0; round < 1000; round++) {
+        uint8_t *blocks[16];
+        for (int index = 0; index < 16; index++) {
+            blocks[index] = allocator->alloc(allocator, 16 << (index % 8));
+            assert(NULL != blocks[index]);
+            blocks[index][0] = (uint8_t)index;
+        }
+        for (int index = 0; index < 16; index++) {
+            assert((uint8_t)index == blocks[index][0]);
+            allocator->free(allocator, blocks[index]);
+        }
+    }
+
+    return NULL;
+}
+
+// A lock-free stack of List-style nodes, used to test the EpochAllocator.
+typedef struct StackNode StackNode;
+typedef struct StackNode {
+    StackNode *next;
+    int data;
+} StackNode;
+
+typedef struct EpochTest {
+    EpochAllocator *epoch_allocator;
+    _Atomic(StackNode*) top;
+} EpochTest;
+
+// Push and pop nodes on a shared stack. Popped nodes are freed right away through the
+// EpochAllocator while other threads may still be reading them.
+static void *epoch_allocator_test_thread(void *arg) {
+    EpochTest *test = (EpochTest*)arg;
+    Allocator *allocator = &test->epoch_allocator->allocator;
+
+    for (int round = 0; round < 10000; round++) {
+        StackNode *node = allocator->alloc(allocator, sizeof(StackNode));
+        assert(NULL != node);
+        node->data = round;
+
+        node->next = atomic_load(&test->top);
+        while (!atomic_compare_exchange_weak(&test->top, &node->next, node)) {
+        }
+
+        epoch_allocator_enter(test->epoch_allocator);
+        StackNode *top = atomic_load(&test->top);
+        while ((NULL != top) && !atomic_compare_exchange_weak(&test->top, &top, top->next)) {
+        }
+        epoch_allocator_exit(test->epoch_allocator);
+
+        if (NULL != top) {
+            allocator->free(allocator, top);
+        }
+    }
+
+    return NULL;
+}
+
+// A coroutine for the StackPool test, which yields the numbers 0 to 9 one at a time
+// back to the caller.
+static ucontext_t stack_pool_test_caller;
+static ucontext_t stack_pool_test_coroutine;
+static uint32_t stack_pool_test_value;
+
+static void stack_pool_test_counter(void) {
+    for (uint32_t value = 0; value < 10; value++) {
+        stack_pool_test_value = value;
+        swapcontext(&stack_pool_test_coroutine, &stack_pool_test_caller);
+    }
+}
+
+// A static bump allocator for the test in main.
+BUMP_ALLOCATOR_STATIC(static_bump_allocator, 4096);
+
+// Two different allocation sites for the SamplingAllocator test.
+__attribute__((noinline)) static void *sampling_test_site_small(Allocator *allocator) {
+    return allocator->alloc(allocator, 16);
+}
+
+__attribute__((noinline)) static void *sampling_test_site_large(Allocator *allocator) {
+    return allocator->alloc(allocator, 4096);
+}
+
+// Allocate from the large site on several threads at once for the SamplingAllocator test.
+static void *sampling_test_thread(void *arg) {
+    Allocator *allocator = (Allocator*)arg;
+
+    for (int index = 0; index < 10000; index++) {
+        allocator->free(allocator, sampling_test_site_large(allocator));
+    }
+
+    return NULL;
+}
 
 int main(int argc, char *argv[]) {
     printf("\nHeap allocator test:\n");
@@ -116,6 +687,45 @@ int main(int argc, char *argv[]) {
         printf("Heap allocator test complete\n");
     }
 
+    printf("\nLarge allocator test:\n");
+    {
+        // anything of 64KB or more is mapped directly.
+        HeapAllocator heap_allocator = heap_allocator_create();
+        LargeAllocator large_allocator = large_allocator_create(&heap_allocator.allocator, 64 * 1024);
+        Allocator *allocator = &large_allocator.allocator;
+
+        // small allocations go to the heap.
+        char *small = allocator->alloc(allocator, 100);
+        assert(NULL != small);
+        memset(small, 'a', 100);
+
+        // grow a small allocation into a large one, keeping its contents.
+        small = allocator->realloc(allocator, small, 1024 * 1024);
+        assert(NULL != small);
+        assert('a' == small[0] && 'a' == small[99]);
+
+        // grow a large allocation by remapping it.
+        const size_t LENGTH = 4 * 1024 * 1024;
+        char *large = allocator->alloc(allocator, LENGTH);
+        assert(NULL != large);
+        memset(large, 'b', LENGTH);
+
+        large = allocator->realloc(allocator, large, 16 * LENGTH);
+        assert(NULL != large);
+        assert('b' == large[0] && 'b' == large[LENGTH - 1]);
+        large[16 * LENGTH - 1] = 'c';
+
+        // shrinking a large allocation into a small one moves it back to the heap.
+        large = allocator->realloc(allocator, large, 100);
+        assert(NULL != large);
+        assert('b' == large[0] && 'b' == large[99]);
+
+        allocator->free(allocator, large);
+        allocator->free(allocator, small);
+        allocator->free(allocator, NULL);
+        printf("Large allocator test complete\n");
+    }
+
     printf("\nArena allocator test\n");
     {
         // Use the heap allocator (aka the system allocator) for our backing allocator.
@@ -154,6 +764,184 @@ int main(int argc, char *argv[]) {
         printf("Arena allocator test complete\n");
     }
 
+    printf("\nChild arena test\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        ArenaAllocator root = arena_allocator_create(&heap_allocator.allocator);
+
+        // a request arena under the root, and a query arena under the request.
+        ArenaAllocator request;
+        arena_allocator_init_child(&root, &request);
+        ArenaAllocator query;
+        arena_allocator_init_child(&request, &query);
+        assert(root.children == &request && request.children == &query);
+
+        // allocate enough in the query to grow it a few times.
+        for (int index = 0; index < 100; index++) {
+            char *memory = query.allocator.alloc(&query.allocator, 100);
+            assert(NULL != memory);
+            memset(memory, index, 100);
+        }
+        assert(NULL != query.retired);
+
+        // clearing the query gives the blocks it grew out of back to the request.
+        arena_allocator_clear(&query);
+        assert(NULL == query.retired);
+        assert(NULL != request.free_blocks);
+
+        // destroying the query gives back the rest.
+        arena_allocator_destroy(&query);
+        assert(NULL == request.children);
+        ArenaBlock *cached = request.free_blocks;
+        assert(NULL != cached);
+
+        // a new child reuses a cached block rather then going to the root.
+        ArenaAllocator stage;
+        arena_allocator_init_child(&request, &stage);
+        char *memory = stage.allocator.alloc(&stage.allocator, 100);
+        assert(NULL != memory);
+        assert((uint8_t*)memory == (uint8_t*)(cached + 1) + sizeof(ArenaBlock));
+
+        // a child that grows through realloc keeps its old block until it is cleared, so a
+        // sibling can't be handed memory the child is still using.
+        ArenaAllocator parent = arena_allocator_create(&heap_allocator.allocator);
+        ArenaAllocator grower;
+        arena_allocator_init_child(&parent, &grower);
+        ArenaAllocator sibling;
+        arena_allocator_init_child(&parent, &sibling);
+        char *first = grower.allocator.alloc(&grower.allocator, 64);
+        assert(NULL != first);
+        memset(first, 'A', 64);
+        assert(NULL != grower.allocator.realloc(&grower.allocator, first, 4096));
+        char *other = sibling.allocator.alloc(&sibling.allocator, 32);
+        assert(NULL != other);
+        memset(other, 'B', 32);
+        for (int index = 0; index < 64; index++) {
+            assert('A' == first[index]);
+        }
+        arena_allocator_destroy(&parent);
+
+        // destroying the request destroys the whole subtree, giving every block to the root.
+        arena_allocator_destroy(&request);
+        assert(NULL == root.children);
+        assert(NULL == stage.memory);
+        assert(NULL != root.free_blocks);
+
+        arena_allocator_destroy(&root);
+        assert(NULL == root.free_blocks);
+        printf("Child arena test complete\n");
+    }
+
+    printf("\nArena purger test\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        ArenaAllocator arena_allocator = arena_allocator_create(&heap_allocator.allocator);
+
+        // no decay, so a cleared arena can be purged on the very next tick.
+        ArenaPurger purger = arena_purger_create(0, 4096, false);
+        arena_purger_register(&purger, &arena_allocator);
+
+        // touch a large block so there are resident pages to give back.
+        const size_t LENGTH = 1024 * 1024;
+        char *memory = arena_allocator.allocator.alloc(&arena_allocator.allocator, LENGTH);
+        assert(NULL != memory);
+        memset(memory, 1, LENGTH);
+
+        // an arena in use is never purged.
+        assert(0 == arena_purger_tick(&purger));
+
+        arena_allocator_clear(&arena_allocator);
+        size_t purged = arena_purger_tick(&purger);
+        assert(0 < purged);
+        assert(purged <= LENGTH);
+        assert(arena_allocator.dirty < LENGTH);
+
+        // nothing new was touched, so there is nothing more to purge.
+        assert(0 == arena_purger_tick(&purger));
+
+        // the arena keeps its memory, and the next allocation reuses it.
+        uint8_t *old_memory = arena_allocator.memory;
+        memory = arena_allocator.allocator.alloc(&arena_allocator.allocator, LENGTH);
+        assert(old_memory == arena_allocator.memory);
+        memset(memory, 2, LENGTH);
+
+        // let a background thread do the purging this time.
+        size_t total_purged = atomic_load(&purger.purged);
+        assert(arena_purger_start(&purger, 1));
+        arena_allocator_clear(&arena_allocator);
+        for (int tries = 0; tries < 1000 && atomic_load(&purger.purged) == total_purged; tries++) {
+            usleep(1000);
+        }
+        arena_purger_stop(&purger);
+        assert(arena_allocator.dirty < LENGTH);
+
+        arena_purger_destroy(&purger);
+        assert(NULL == arena_allocator.purger);
+
+        arena_allocator_destroy(&arena_allocator);
+        printf("Arena purger test complete\n");
+    }
+
+    printf("\nAdaptive arena test\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        AdaptiveArena adaptive_arena = adaptive_arena_create(&heap_allocator.allocator, 90);
+        Allocator *allocator = &adaptive_arena.arena.allocator;
+
+        // nothing has been learned yet.
+        assert(0 == adaptive_arena_learned_size(&adaptive_arena));
+
+        // run a few generations which each use about the same amount of memory.
+        for (int generation = 0; generation < ADAPTIVE_ARENA_HISTORY; generation++) {
+            for (int index = 0; index < 100; index++) {
+                char *memory = allocator->alloc(allocator, 100 + generation);
+                assert(NULL != memory);
+            }
+            adaptive_arena_reset(&adaptive_arena);
+        }
+
+        // the arena now starts each generation large enough for a typical generation.
+        size_t learned = adaptive_arena_learned_size(&adaptive_arena);
+        assert(100 * 100 <= learned);
+        assert(learned <= adaptive_arena.arena.length);
+
+        // so the next generation does not need to grow.
+        uint8_t *old_memory = adaptive_arena.arena.memory;
+        for (int index = 0; index < 100; index++) {
+            char *memory = allocator->alloc(allocator, 100);
+            assert(NULL != memory);
+        }
+        assert(old_memory == adaptive_arena.arena.memory);
+
+        // a single outlier generation does not move a high percentile once there is some history.
+        char *memory = allocator->alloc(allocator, 1000000);
+        assert(NULL != memory);
+        adaptive_arena_reset(&adaptive_arena);
+        assert(adaptive_arena_learned_size(&adaptive_arena) < 1000000);
+
+        adaptive_arena_destroy(&adaptive_arena);
+        assert(NULL == adaptive_arena.arena.memory);
+
+        // resetting an arena which a running purger watches swaps its block out from
+        // under the purger, so the reset has to take the arena back first.
+        adaptive_arena = adaptive_arena_create(&heap_allocator.allocator, 50);
+        ArenaPurger purger = arena_purger_create(0, 0, false);
+        arena_purger_register(&purger, &adaptive_arena.arena);
+        assert(arena_purger_start(&purger, 1));
+        for (int generation = 0; generation < 64; generation++) {
+            size_t size = (generation % 2) ? 4096 : 64 * 1024;
+            memory = allocator->alloc(allocator, size);
+            assert(NULL != memory);
+            memset(memory, 1, size);
+            adaptive_arena_reset(&adaptive_arena);
+            usleep(100);
+        }
+        arena_purger_stop(&purger);
+        arena_purger_destroy(&purger);
+        adaptive_arena_destroy(&adaptive_arena);
+        printf("Adaptive arena test complete\n");
+    }
+
     printf("\nBump allocator test\n");
     {
         // allocate some memory to use for the bump allocator.
@@ -209,11 +997,428 @@ int main(int argc, char *argv[]) {
 
         printf("Bump allocator test complete\n");
     }
+
+    printf("\nStatic bump allocator test\n");
+    {
+        // the allocator is ready to use without being created.
+        Allocator *allocator = &static_bump_allocator.allocator;
+        assert(4096 == static_bump_allocator.length);
+        assert(0 == (uintptr_t)static_bump_allocator.memory % _Alignof(max_align_t));
+
+        char *memory = allocator->alloc(allocator, 1000);
+        assert((uint8_t*)memory == static_bump_allocator_memory);
+
+        // the whole block can be used, but no more.
+        memory = allocator->alloc(allocator, 4096 - 1000);
+        assert(NULL != memory);
+        assert(NULL == allocator->alloc(allocator, 1));
+        assert(NULL == allocator->alloc(allocator, SIZE_MAX));
+
+        bump_allocator_free_all(allocator);
+        assert(0 == static_bump_allocator.count);
+        printf("Static bump allocator test complete\n");
+    }
+
+    printf("\nPer-CPU allocator test\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        PerCpuAllocator per_cpu_allocator = per_cpu_allocator_create(&heap_allocator.allocator);
+        assert(NULL != per_cpu_allocator.shards);
+        assert(0 < per_cpu_allocator.num_shards);
+        assert(0 == (uintptr_t)per_cpu_allocator.shards % _Alignof(PerCpuShard));
+
+        Allocator *allocator = &per_cpu_allocator.allocator;
+
+        // allocations of any size work, cached or not.
+        char *small = allocator->alloc(allocator, 24);
+        char *large = allocator->alloc(allocator, 100000);
+        assert(NULL != small && NULL != large);
+        memset(small, 1, 24);
+        memset(large, 2, 100000);
+
+        // realloc within the same size class keeps the block.
+        assert(small == allocator->realloc(allocator, small, 32));
+        small = allocator->realloc(allocator, small, 1000);
+        assert(NULL != small && 1 == small[23]);
+
+        allocator->free(allocator, small);
+        allocator->free(allocator, large);
+
+        // hammer the allocator from more threads than there are CPUs.
+        pthread_t threads[8];
+        for (int index = 0; index < 8; index++) {
+            int result = pthread_create(&threads[index], NULL, per_cpu_allocator_test_thread, allocator);
+            assert(0 == result);
+        }
+        for (int index = 0; index < 8; index++) {
+            pthread_join(threads[index], NULL);
+        }
+
+        per_cpu_allocator_destroy(&per_cpu_allocator);
+        assert(NULL == per_cpu_allocator.shards);
+
+        // without room for the shards, the allocator passes everything to its backing allocator.
+        uint8_t memory[sizeof(PerCpuShard) - 1];
+        BumpAllocator bump_allocator = bump_allocator_create(sizeof(memory), memory);
+        per_cpu_allocator = per_cpu_allocator_create(&bump_allocator.allocator);
+        assert(NULL == per_cpu_allocator.shards);
+        assert(0 == per_cpu_allocator.num_shards);
+
+        small = allocator->alloc(allocator, 16);
+        assert(NULL != small);
+        memset(small, 3, 16);
+        small = allocator->realloc(allocator, small, 24);
+        assert(NULL != small && 3 == small[15]);
+        allocator->free(allocator, small);
+        per_cpu_allocator_destroy(&per_cpu_allocator);
+        printf("Per-CPU allocator test complete\n");
+    }
+
+    printf("\nEpoch allocator test\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        EpochAllocator epoch_allocator = epoch_allocator_create(&heap_allocator.allocator);
+        Allocator *allocator = &epoch_allocator.allocator;
+
+        // freeing while a reader is active only retires the pointer.
+        epoch_allocator_enter(&epoch_allocator);
+        char *memory = allocator->alloc(allocator, 100);
+        assert(NULL != memory);
+        allocator->free(allocator, memory);
+        assert(1 == epoch_allocator_pending(&epoch_allocator));
+
+        // the epoch can move once, but not twice, while we are inside the old epoch.
+        epoch_allocator_try_advance(&epoch_allocator);
+        assert(0 == epoch_allocator_collect(&epoch_allocator));
+        assert(1 == epoch_allocator_pending(&epoch_allocator));
+        epoch_allocator_exit(&epoch_allocator);
+
+        // once no one is reading, the pointer is freed after the epoch moves on.
+        assert(1 == epoch_allocator_collect(&epoch_allocator));
+        assert(0 == epoch_allocator_pending(&epoch_allocator));
+
+        // realloc keeps the contents, retiring the old pointer.
+        memory = allocator->alloc(allocator, 10);
+        strcpy(memory, "epoch");
+        memory = allocator->realloc(allocator, memory, 1000);
+        assert(0 == strcmp("epoch", memory));
+        allocator->free(allocator, memory);
+
+        // build a lock-free stack from several threads at once.
+        EpochTest test = { &epoch_allocator, NULL };
+        pthread_t threads[4];
+        for (int index = 0; index < 4; index++) {
+            int result = pthread_create(&threads[index], NULL, epoch_allocator_test_thread, &test);
+            assert(0 == result);
+        }
+        for (int index = 0; index < 4; index++) {
+            pthread_join(threads[index], NULL);
+        }
+
+        // every thread popped as many times as it pushed.
+        assert(NULL == atomic_load(&test.top));
+
+        epoch_allocator_destroy(&epoch_allocator);
+        printf("Epoch allocator test complete\n");
+    }
+
+    printf("\nSnapshot arena test\n");
+    {
+        SnapshotArena snapshot_arena = snapshot_arena_create(1024 * 1024);
+        assert(NULL != snapshot_arena.memory);
+        Allocator *allocator = &snapshot_arena.allocator;
+
+        // build a small list in the arena.
+        StackNode *second = allocator->alloc(allocator, sizeof(StackNode));
+        StackNode *first = allocator->alloc(allocator, sizeof(StackNode));
+        *second = (StackNode){ NULL, 2 };
+        *first = (StackNode){ second, 1 };
+
+        // the snapshot keeps seeing the list as it was, while the arena moves on.
+        ArenaSnapshot snapshot = snapshot_arena_snapshot(&snapshot_arena);
+        assert(NULL != snapshot.memory);
+        size_t count = snapshot_arena.count;
+
+        first->data = 10;
+        StackNode *third = allocator->alloc(allocator, sizeof(StackNode));
+        *third = (StackNode){ NULL, 3 };
+        second->next = third;
+
+        const StackNode *view = arena_snapshot_ptr(&snapshot, &snapshot_arena, first);
+        assert(1 == view->data);
+        const StackNode *view_second = arena_snapshot_ptr(&snapshot, &snapshot_arena, view->next);
+        assert(2 == view_second->data && NULL == view_second->next);
+        assert(10 == first->data);
+
+        // a second snapshot sees the changes, and the first still does not.
+        ArenaSnapshot later = snapshot_arena_snapshot(&snapshot_arena);
+        assert(NULL != later.memory);
+        first->data = 20;
+        view = arena_snapshot_ptr(&later, &snapshot_arena, first);
+        assert(10 == view->data);
+        view = arena_snapshot_ptr(&snapshot, &snapshot_arena, first);
+        assert(1 == view->data);
+
+        // roll the arena back to the first snapshot.
+        assert(snapshot_arena_restore(&snapshot_arena, &snapshot));
+        assert(count == snapshot_arena.count);
+        assert(1 == first->data && NULL == second->next);
+
+        // the arena shares the first snapshot's file now, so it stays frozen until that is released.
+        arena_snapshot_release(&later, &snapshot_arena);
+        assert(snapshot_arena.frozen);
+        arena_snapshot_release(&snapshot, &snapshot_arena);
+        assert(NULL == snapshot.memory);
+        assert(!snapshot_arena.frozen && NULL == snapshot_arena.refs);
+
+        // the arena keeps working after its snapshots are gone, and writes to its file again.
+        first->data = 30;
+        int data = 0;
+        off_t offset = (uint8_t*)first - snapshot_arena.memory + offsetof(StackNode, data);
+        assert(sizeof(data) == pread(snapshot_arena.fd, &data, sizeof(data), offset));
+        assert(30 == data);
+
+        // a snapshot taken after a restore gets its own file, and it is the one that unfreezes the arena.
+        snapshot = snapshot_arena_snapshot(&snapshot_arena);
+        assert(NULL != snapshot.memory);
+        assert(snapshot_arena_restore(&snapshot_arena, &snapshot));
+        later = snapshot_arena_snapshot(&snapshot_arena);
+        assert(NULL != later.memory);
+        first->data = 40;
+        arena_snapshot_release(&snapshot, &snapshot_arena);
+        assert(snapshot_arena.frozen);
+        arena_snapshot_release(&later, &snapshot_arena);
+        assert(!snapshot_arena.frozen);
+        assert(40 == first->data);
+
+        snapshot_arena_destroy(&snapshot_arena);
+        assert(NULL == snapshot_arena.memory);
+        printf("Snapshot arena test complete\n");
+    }
+
+    printf("\nStack pool test\n");
+    {
+        StackPool stack_pool = stack_pool_create(64 * 1024, 1, 4, true);
+
+        // a released stack is handed out again.
+        void *stack = stack_pool_acquire(&stack_pool);
+        assert(NULL != stack);
+        stack_pool_release(&stack_pool, stack);
+        assert(1 == stack_pool.free_count);
+        assert(stack == stack_pool_acquire(&stack_pool));
+        assert(0 == stack_pool.free_count);
+
+        // run a coroutine on the stack, summing what it yields.
+        getcontext(&stack_pool_test_coroutine);
+        stack_pool_test_coroutine.uc_stack.ss_sp = stack;
+        stack_pool_test_coroutine.uc_stack.ss_size = stack_pool.stack_size;
+        stack_pool_test_coroutine.uc_link = &stack_pool_test_caller;
+        makecontext(&stack_pool_test_coroutine, stack_pool_test_counter, 0);
+
+        uint32_t sum = 0;
+        for (int index = 0; index < 10; index++) {
+            swapcontext(&stack_pool_test_caller, &stack_pool_test_coroutine);
+            sum += stack_pool_test_value;
+        }
+        // let the coroutine return.
+        swapcontext(&stack_pool_test_caller, &stack_pool_test_coroutine);
+        assert(45 == sum);
+
+        // the allocator interface hands out stacks too, but nothing larger then a stack.
+        Allocator *allocator = &stack_pool.allocator;
+        void *other = allocator->alloc(allocator, 1024);
+        assert(NULL != other && stack != other);
+        assert(other == allocator->realloc(allocator, other, stack_pool.stack_size));
+        assert(NULL == allocator->alloc(allocator, stack_pool.stack_size + 1));
+        allocator->free(allocator, other);
+
+        // only max_free stacks are kept.
+        void *stacks[6];
+        for (int index = 0; index < 6; index++) {
+            stacks[index] = stack_pool_acquire(&stack_pool);
+            assert(NULL != stacks[index]);
+        }
+        for (int index = 0; index < 6; index++) {
+            stack_pool_release(&stack_pool, stacks[index]);
+        }
+        assert(4 == stack_pool.free_count);
+
+        stack_pool_release(&stack_pool, stack);
+        stack_pool_destroy(&stack_pool);
+        assert(0 == stack_pool.free_count);
+        printf("Stack pool test complete\n");
+    }
+
+    printf("\nStats allocator test\n");
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "/dev/shm/alloc_stats.%d", (int)getpid());
+
+        StatsRegion stats_region = stats_region_create(path, 4);
+        assert(NULL != stats_region.header);
+        StatsSlot *slot = stats_region_slot(&stats_region, "request arena");
+        assert(NULL != slot);
+
+        // count the memory an arena gets from the heap.
+        HeapAllocator heap_allocator = heap_allocator_create();
+        StatsAllocator stats_allocator = stats_allocator_create(&heap_allocator.allocator, slot);
+        ArenaAllocator arena_allocator = arena_allocator_create(&stats_allocator.allocator);
+
+        for (int index = 0; index < 100; index++) {
+            char *memory = arena_allocator.allocator.alloc(&arena_allocator.allocator, 100);
+            assert(NULL != memory);
+        }
+        stats_allocator_sample_arena(slot, &arena_allocator);
+        assert(0 < atomic_load(&slot->alloc_calls));
+        assert(0 < atomic_load(&slot->bytes_in_use));
+        assert(10000 == atomic_load(&slot->arena_count));
+
+        // another mapping of the file, like the one a reader would make, sees the same counters.
+        int fd = open(path, O_RDONLY);
+        assert(0 <= fd);
+        const StatsHeader *header = mmap(NULL, stats_region.length, PROT_READ, MAP_SHARED, fd, 0);
+        assert(MAP_FAILED != header);
+        close(fd);
+        assert(STATS_MAGIC == header->magic);
+        assert(1 == atomic_load(&header->used_slots));
+        const StatsSlot *reader_slot = (const StatsSlot*)(header + 1);
+        assert(0 == strcmp("request arena", reader_slot->name));
+        assert(atomic_load(&slot->bytes_in_use) == atomic_load(&reader_slot->bytes_in_use));
+
+        // once the arena is gone, nothing is in use, but the peak is remembered.
+        arena_allocator_destroy(&arena_allocator);
+        assert(0 == atomic_load(&reader_slot->bytes_in_use));
+        assert(0 < atomic_load(&reader_slot->peak_bytes));
+        assert(atomic_load(&slot->alloc_calls) == atomic_load(&slot->free_calls));
+
+        munmap((void*)header, stats_region.length);
+        stats_region_destroy(&stats_region);
+        assert(0 != access(path, F_OK));
+        printf("Stats allocator test complete\n");
+    }
+
+    printf("\nSampling allocator test\n");
+    {
+        // sample about once every 64KB.
+        HeapAllocator heap_allocator = heap_allocator_create();
+        SamplingAllocator sampling_allocator = sampling_allocator_create(&heap_allocator.allocator, 64 * 1024);
+        Allocator *allocator = &sampling_allocator.allocator;
+
+        // allocate a lot more from the large site then from the small one.
+        for (int index = 0; index < 10000; index++) {
+            allocator->free(allocator, sampling_test_site_small(allocator));
+            allocator->free(allocator, sampling_test_site_large(allocator));
+        }
+
+        // both sites were seen, and the estimate of the total is in the right ballpark.
+        uint64_t samples = 0;
+        uint64_t bytes = 0;
+        for (size_t index = 0; index < sampling_allocator.capacity; index++) {
+            samples += sampling_allocator.sites[index].samples;
+            bytes += sampling_allocator.sites[index].bytes;
+        }
+        const uint64_t total = 10000 * (16 + 4096);
+        assert(2 <= sampling_allocator.num_sites);
+        assert(total / 2 < bytes && bytes < total * 2);
+        assert(samples < 10000);
+
+        // the folded profile has a line per site.
+        FILE *file = tmpfile();
+        assert(NULL != file);
+        sampling_allocator_dump_folded(&sampling_allocator, file);
+        rewind(file);
+        size_t lines = 0;
+        for (int chr = fgetc(file); EOF != chr; chr = fgetc(file)) {
+            lines += '\n' == chr;
+        }
+        assert(sampling_allocator.num_sites == lines);
+        fclose(file);
+        sampling_allocator_destroy(&sampling_allocator);
+
+        // threads sharing the allocator still add up to about what they allocated.
+        sampling_allocator = sampling_allocator_create(&heap_allocator.allocator, 64 * 1024);
+        pthread_t threads[4];
+        for (int index = 0; index < 4; index++) {
+            int result = pthread_create(&threads[index], NULL, sampling_test_thread, allocator);
+            assert(0 == result);
+        }
+        for (int index = 0; index < 4; index++) {
+            pthread_join(threads[index], NULL);
+        }
+        bytes = 0;
+        for (size_t index = 0; index < sampling_allocator.capacity; index++) {
+            bytes += sampling_allocator.sites[index].bytes;
+        }
+        const uint64_t threaded_total = 4 * 10000 * 4096;
+        assert(threaded_total / 2 < bytes && bytes < threaded_total * 2);
+
+        sampling_allocator_destroy(&sampling_allocator);
+
+        // allocations larger then the sample rate are each sampled once, standing for their size.
+        sampling_allocator = sampling_allocator_create(&heap_allocator.allocator, 64 * 1024);
+        for (int index = 0; index < 100; index++) {
+            allocator->free(allocator, allocator->alloc(allocator, 1024 * 1024));
+        }
+        samples = 0;
+        bytes = 0;
+        for (size_t index = 0; index < sampling_allocator.capacity; index++) {
+            samples += sampling_allocator.sites[index].samples;
+            bytes += sampling_allocator.sites[index].bytes;
+        }
+        assert(100 == samples);
+        assert((uint64_t)100 * 1024 * 1024 == bytes);
+
+        sampling_allocator_destroy(&sampling_allocator);
+        assert(NULL == sampling_allocator.sites);
+        printf("Sampling allocator test complete\n");
+    }
+
+    printf("\nGood size test\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        LargeAllocator large_allocator = large_allocator_create(&heap_allocator.allocator, 64 * 1024);
+        ArenaAllocator arena_allocator = arena_allocator_create(&heap_allocator.allocator);
+        PerCpuAllocator per_cpu_allocator = per_cpu_allocator_create(&heap_allocator.allocator);
+
+        // the heap rounds small sizes up, so a small request has some room to spare.
+        Allocator *heap = &heap_allocator.allocator;
+        assert(heap->good_size(heap, 1) > 1);
+        assert(heap->good_size(heap, 100) >= 100);
+
+        // the per-CPU allocator rounds to its size classes.
+        Allocator *per_cpu = &per_cpu_allocator.allocator;
+        assert(32 == per_cpu->good_size(per_cpu, 24));
+        assert(4096 == per_cpu->good_size(per_cpu, 4000));
+
+        // the arena gives exactly what it is asked for.
+        Allocator *arena = &arena_allocator.allocator;
+        assert(100 == arena->good_size(arena, 100));
+
+        // for every allocator, the good size is at least the size, and all of it can be used.
+        Allocator *allocators[] = { heap, &large_allocator.allocator, arena, per_cpu };
+        size_t sizes[] = { 1, 24, 100, 4000, 5000, 64 * 1024 - 1, 100000 };
+        for (size_t index = 0; index < sizeof(allocators) / sizeof(allocators[0]); index++) {
+            Allocator *allocator = allocators[index];
+            for (size_t size_index = 0; size_index < sizeof(sizes) / sizeof(sizes[0]); size_index++) {
+                size_t good_size = allocator->good_size(allocator, sizes[size_index]);
+                assert(good_size >= sizes[size_index]);
+
+                uint8_t *memory = allocator->alloc(allocator, good_size);
+                assert(NULL != memory);
+                memset(memory, 0xAA, good_size);
+                allocator->free(allocator, memory);
+            }
+        }
+
+        per_cpu_allocator_destroy(&per_cpu_allocator);
+        arena_allocator_destroy(&arena_allocator);
+        printf("Good size test complete\n");
+    }
 }
 
 /* Heap Allocator */
 HeapAllocator heap_allocator_create(void) {
-    return (HeapAllocator) { { heap_allocator_alloc, heap_allocator_free, heap_allocator_realloc, } };
+    return (HeapAllocator) { { heap_allocator_alloc, heap_allocator_free, heap_allocator_realloc, heap_allocator_good_size, } };
 }
 
 void *heap_allocator_alloc(Allocator *allocator, size_t size) {
@@ -234,115 +1439,659 @@ void *heap_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_siz
     return realloc(old_ptr, new_size);
 }
 
-/* Arena Allocator */
-ArenaAllocator arena_allocator_create(Allocator *backing_allocator) {
-    Allocator allocator = (Allocator) { arena_allocator_alloc, arena_allocator_free, arena_allocator_realloc, };
-
-    // we start with no memory allocated here, to make allocator creation fast
-    return (ArenaAllocator){ allocator, backing_allocator, NULL, 0, 0 };
-}
-
-void arena_allocator_destroy(ArenaAllocator *arena_allocator) {
-    if (NULL != arena_allocator->memory) {
-        // free using the same allocator that allocated the memory.
-        arena_allocator->backing_allocator->free(arena_allocator->backing_allocator, arena_allocator->memory);
+// The heap allocator rounds sizes up to the chunk sizes of glibc's malloc: the size plus a
+// size_t of overhead, rounded up to a multiple of two size_t's, and at least four size_t's
+// in all. The size we can use is the chunk without its overhead.
+size_t heap_allocator_good_size(Allocator *allocator, size_t size) {
+    const size_t word = sizeof(size_t);
 
-        // null our pointer to ensure no one uses it accidentally.
-        arena_allocator->memory = NULL;
+    size_t chunk = (size + word + 2 * word - 1) & ~(2 * word - 1);
+    if (chunk < 4 * word) {
+        chunk = 4 * word;
     }
-}
-
-// Clearing an arena allocator frees all allocations at once, reseting the stack allocations to the
-// front (the count of used bytes = 0).
-void arena_allocator_clear(ArenaAllocator *arena_allocator) {
-    assert(NULL != arena_allocator);
 
-    arena_allocator->count = 0;
+    return chunk - word;
 }
 
-void *arena_allocator_alloc(Allocator *allocator, size_t size) {
-    ArenaAllocator *arena_allocator = (ArenaAllocator*)container_of(allocator, ArenaAllocator, allocator);
+/* Large Allocator */
+LargeAllocator large_allocator_create(Allocator *backing_allocator, size_t threshold) {
+    Allocator allocator = (Allocator){ large_allocator_alloc, large_allocator_free, large_allocator_realloc, large_allocator_good_size, };
+    return (LargeAllocator){ allocator, backing_allocator, threshold };
+}
 
-    size_t new_count = arena_allocator->count + size;
+// The mapping length needed to hold an allocation of the given size and its header.
+static size_t large_allocator_mapping_length(size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return (sizeof(LargeHeader) + size + page_size - 1) & ~(page_size - 1);
+}
 
-    // if there is not enough memory, create a larger stack
-    if (new_count > arena_allocator->length) {
-        size_t new_length = arena_allocator->length * 2;
+void *large_allocator_alloc(Allocator *allocator, size_t size) {
+    LargeAllocator *large_allocator = (LargeAllocator*)container_of(allocator, LargeAllocator, allocator);
 
-        // if we asked for more then twice the amount, just allocate enough to allow the allocation to occur.
-        if (new_length < new_count) {
-            new_length = new_count;
+    LargeHeader *header = NULL;
+    if (size >= large_allocator->threshold) {
+        size_t mapped = large_allocator_mapping_length(size);
+        void *mapping = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == mapping) {
+            return NULL;
         }
 
-        arena_allocator->memory =
-            arena_allocator->backing_allocator->alloc(arena_allocator->backing_allocator, new_count);
-        // NOTE should check for a NULL result.
+        header = (LargeHeader*)mapping;
+        header->mapped = mapped;
+    } else {
+        Allocator *backing_allocator = large_allocator->backing_allocator;
+        header = backing_allocator->alloc(backing_allocator, sizeof(LargeHeader) + size);
+        if (NULL == header) {
+            return NULL;
+        }
 
-        arena_allocator->length = new_length;
+        header->mapped = 0;
     }
+    header->size = size;
 
-    char *ptr = &arena_allocator->memory[arena_allocator->count];
-    arena_allocator->count = new_count;
-
-    return ptr;
+    return header + 1;
 }
 
-// As with the bump allocator, we could check if the ptr is to the last allocation
-// and free if so, allowing a stack allocation pattern. This is omitted for
-// simplicity.
-void arena_allocator_free(Allocator *allocator, void *ptr) {
-    // we don't free anything- we free all at once or not at all.
-    (void)allocator;
-    (void)ptr;
+void large_allocator_free(Allocator *allocator, void *ptr) {
+    LargeAllocator *large_allocator = (LargeAllocator*)container_of(allocator, LargeAllocator, allocator);
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    LargeHeader *header = (LargeHeader*)ptr - 1;
+    if (0 != header->mapped) {
+        munmap(header, header->mapped);
+    } else {
+        large_allocator->backing_allocator->free(large_allocator->backing_allocator, header);
+    }
 }
 
-void *arena_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size) {
-    ArenaAllocator *arena_allocator = (ArenaAllocator*)container_of(allocator, ArenaAllocator, allocator);
+void *large_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    LargeAllocator *large_allocator = (LargeAllocator*)container_of(allocator, LargeAllocator, allocator);
 
-    // just allocate at the end, like a normal allocation.
-    size_t new_count = arena_allocator->count + size;
+    if (NULL == old_ptr) {
+        return large_allocator_alloc(allocator, new_size);
+    }
 
-    // if there is not enough memory, create a larger stack
-    if (new_count > arena_allocator->length) {
-        size_t new_length = arena_allocator->length * 2;
+    LargeHeader *header = (LargeHeader*)old_ptr - 1;
+    bool large = new_size >= large_allocator->threshold;
 
-        // if we asked for more then twice the amount, just allocate enough to allow the allocation to occur.
-        if (new_length < new_count) {
-            new_length = new_count;
+    // small to small stays within the backing allocator.
+    if ((0 == header->mapped) && !large) {
+        Allocator *backing_allocator = large_allocator->backing_allocator;
+        header = backing_allocator->realloc(backing_allocator, header, sizeof(LargeHeader) + new_size);
+        if (NULL == header) {
+            return NULL;
         }
 
-        arena_allocator->memory =
-            arena_allocator->backing_allocator->realloc(arena_allocator->backing_allocator, arena_allocator->memory, new_length);
-        // NOTE should check for a NULL result.
+        header->size = new_size;
+        return header + 1;
+    }
 
-        arena_allocator->length = new_length;
+    // large to large just remaps the pages, moving the mapping if it can't grow in place.
+    if ((0 != header->mapped) && large) {
+        size_t mapped = large_allocator_mapping_length(new_size);
+        if (mapped != header->mapped) {
+            void *mapping = mremap(header, header->mapped, mapped, MREMAP_MAYMOVE);
+            if (MAP_FAILED == mapping) {
+                return NULL;
+            }
+
+            header = (LargeHeader*)mapping;
+            header->mapped = mapped;
+        }
+
+        header->size = new_size;
+        return header + 1;
     }
 
-    char *ptr = &arena_allocator->memory[arena_allocator->count];
-    arena_allocator->count = new_count;
+    // moving between the backing allocator and a mapping requires a copy.
+    void *new_ptr = large_allocator_alloc(allocator, new_size);
+    if (NULL == new_ptr) {
+        return NULL;
+    }
 
-    return ptr;
+    size_t copy_size = header->size < new_size ? header->size : new_size;
+    memcpy(new_ptr, old_ptr, copy_size);
+    large_allocator_free(allocator, old_ptr);
+
+    return new_ptr;
 }
 
+// Mapped allocations get the rest of their last page. Smaller allocations get whatever
+// the backing allocator rounds to, but never enough to become a mapped allocation.
+size_t large_allocator_good_size(Allocator *allocator, size_t size) {
+    LargeAllocator *large_allocator = (LargeAllocator*)container_of(allocator, LargeAllocator, allocator);
+    Allocator *backing_allocator = large_allocator->backing_allocator;
 
-/* Bump Allocator */
-BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory) {
-    Allocator allocator = (Allocator){ bump_allocator_alloc, bump_allocator_free, bump_allocator_realloc };
-    return (BumpAllocator){ allocator, memory, 0, capacity };
-}
+    if (size >= large_allocator->threshold) {
+        return large_allocator_mapping_length(size) - sizeof(LargeHeader);
+    }
 
-void bump_allocator_destroy(BumpAllocator *bump_allocator) {
-    if (NULL != bump_allocator->memory) {
-        bump_allocator->memory = NULL;
+    size_t good_size = backing_allocator->good_size(backing_allocator, sizeof(LargeHeader) + size) - sizeof(LargeHeader);
+    if (good_size >= large_allocator->threshold) {
+        good_size = large_allocator->threshold - 1;
     }
+
+    return good_size;
 }
 
-void *bump_allocator_alloc(Allocator *allocator, size_t size) {
-    BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
+/* Arena Allocator */
+ArenaAllocator arena_allocator_create(Allocator *backing_allocator) {
+    Allocator allocator = (Allocator) { arena_allocator_alloc, arena_allocator_free, arena_allocator_realloc, arena_allocator_good_size, };
+    Allocator block_allocator = (Allocator) { arena_allocator_block_alloc, arena_allocator_block_free, arena_allocator_block_realloc, arena_allocator_block_good_size, };
 
-    char *ptr = NULL;
-    // there is an overflow issue here...
-    if ((bump_allocator->count + size) < bump_allocator->length) {
+    // we start with no memory allocated here, to make allocator creation fast
+    return (ArenaAllocator){
+        allocator, backing_allocator, NULL, 0, 0,
+        NULL, NULL, ARENA_ACTIVE, 0, 0,
+        NULL,
+        NULL, NULL, NULL, block_allocator, NULL,
+    };
+}
+
+// Create a child arena in place, getting its memory from the parent. The parent must
+// stay where it is for as long as it has children.
+void arena_allocator_init_child(ArenaAllocator *parent, ArenaAllocator *child) {
+    *child = arena_allocator_create(&parent->block_allocator);
+
+    child->parent = parent;
+    child->sibling = parent->children;
+    parent->children = child;
+}
+
+// Get a new block with room for length bytes from the backing allocator, returning a
+// pointer to the usable memory after the block's header.
+static uint8_t *arena_allocator_block_create(ArenaAllocator *arena_allocator, size_t length) {
+    Allocator *backing_allocator = arena_allocator->backing_allocator;
+
+    ArenaBlock *block = backing_allocator->alloc(backing_allocator, sizeof(ArenaBlock) + length);
+    if (NULL == block) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->length = length;
+
+    return (uint8_t*)(block + 1);
+}
+
+// Give every block in a list back to the backing allocator.
+static void arena_allocator_block_list_destroy(ArenaAllocator *arena_allocator, ArenaBlock *block) {
+    Allocator *backing_allocator = arena_allocator->backing_allocator;
+
+    while (NULL != block) {
+        ArenaBlock *next = block->next;
+        backing_allocator->free(backing_allocator, block);
+        block = next;
+    }
+}
+
+// Destroying an arena destroys its whole subtree. Each arena gives its blocks back to its
+// parent, so this takes time in the number of blocks, not the number of allocations.
+void arena_allocator_destroy(ArenaAllocator *arena_allocator) {
+    while (NULL != arena_allocator->children) {
+        arena_allocator_destroy(arena_allocator->children);
+    }
+
+    if (NULL != arena_allocator->parent) {
+        ArenaAllocator **link = &arena_allocator->parent->children;
+        while (*link != arena_allocator) {
+            link = &(*link)->sibling;
+        }
+        *link = arena_allocator->sibling;
+
+        arena_allocator->parent = NULL;
+        arena_allocator->sibling = NULL;
+    }
+
+    // the purger must not look at this arena's memory once it is gone.
+    if (NULL != arena_allocator->purger) {
+        arena_purger_unregister(arena_allocator->purger, arena_allocator);
+    }
+
+    arena_allocator_block_list_destroy(arena_allocator, arena_allocator->retired);
+    arena_allocator->retired = NULL;
+
+    arena_allocator_block_list_destroy(arena_allocator, arena_allocator->free_blocks);
+    arena_allocator->free_blocks = NULL;
+
+    if (NULL != arena_allocator->memory) {
+        // free using the same allocator that allocated the memory.
+        arena_allocator->backing_allocator->free(arena_allocator->backing_allocator, (ArenaBlock*)arena_allocator->memory - 1);
+
+        // null our pointer to ensure no one uses it accidentally.
+        arena_allocator->memory = NULL;
+    }
+}
+
+// The current time, used by the ArenaPurger to age idle arenas. This is in
+// nanoseconds, from a clock that does not jump around.
+static uint64_t arena_purger_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Take an idle arena back from the purger before touching its memory. If the purger
+// is in the middle of releasing pages we wait for it to finish.
+static void arena_allocator_wake(ArenaAllocator *arena_allocator) {
+    while (atomic_load_explicit(&arena_allocator->state, memory_order_acquire) != ARENA_ACTIVE) {
+        int expected = ARENA_IDLE;
+        atomic_compare_exchange_weak_explicit(&arena_allocator->state, &expected, ARENA_ACTIVE,
+                                              memory_order_acq_rel, memory_order_acquire);
+    }
+}
+
+// Clearing an arena allocator frees all allocations at once, reseting the stack allocations to the
+// front (the count of used bytes = 0).
+void arena_allocator_clear(ArenaAllocator *arena_allocator) {
+    assert(NULL != arena_allocator);
+
+    // an arena that is already idle may be cleared again, so take it back from the
+    // purger before changing the fields it reads.
+    if (NULL != arena_allocator->purger) {
+        arena_allocator_wake(arena_allocator);
+    }
+
+    // all allocations are gone, so the blocks we grew out of can be freed.
+    arena_allocator_block_list_destroy(arena_allocator, arena_allocator->retired);
+    arena_allocator->retired = NULL;
+
+    if (arena_allocator->count > arena_allocator->dirty) {
+        arena_allocator->dirty = arena_allocator->count;
+    }
+    arena_allocator->count = 0;
+
+    // hand the arena over to the purger, if there is one.
+    if (NULL != arena_allocator->purger) {
+        arena_allocator->idle_since = arena_purger_now();
+        atomic_store_explicit(&arena_allocator->state, ARENA_IDLE, memory_order_release);
+    }
+}
+
+void *arena_allocator_alloc(Allocator *allocator, size_t size) {
+    ArenaAllocator *arena_allocator = (ArenaAllocator*)container_of(allocator, ArenaAllocator, allocator);
+
+    if (NULL != arena_allocator->purger) {
+        arena_allocator_wake(arena_allocator);
+    }
+
+    size_t new_count = arena_allocator->count + size;
+
+    // if there is not enough memory, create a larger stack
+    if (new_count > arena_allocator->length) {
+        size_t new_length = arena_allocator->length * 2;
+
+        // if we asked for more then twice the amount, just allocate enough to allow the allocation to occur.
+        if (new_length < new_count) {
+            new_length = new_count;
+        }
+
+        uint8_t *memory = arena_allocator_block_create(arena_allocator, new_length);
+        if (NULL == memory) {
+            return NULL;
+        }
+
+        // keep the old block around, as its allocations are still in use.
+        if (NULL != arena_allocator->memory) {
+            ArenaBlock *old_block = (ArenaBlock*)arena_allocator->memory - 1;
+            old_block->next = arena_allocator->retired;
+            arena_allocator->retired = old_block;
+        }
+
+        arena_allocator->memory = memory;
+        arena_allocator->length = new_length;
+    }
+
+    char *ptr = &arena_allocator->memory[arena_allocator->count];
+    arena_allocator->count = new_count;
+
+    return ptr;
+}
+
+// As with the bump allocator, we could check if the ptr is to the last allocation
+// and free if so, allowing a stack allocation pattern. This is omitted for
+// simplicity.
+void arena_allocator_free(Allocator *allocator, void *ptr) {
+    // we don't free anything- we free all at once or not at all.
+    (void)allocator;
+    (void)ptr;
+}
+
+// The arena can't resize an allocation in place, so realloc is just an allocation at the
+// end. Growing for it goes through arena_allocator_alloc, so the old block is retired
+// rather then reallocated, as earlier allocations may still point into it.
+void *arena_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size) {
+    (void)old_ptr;
+    return arena_allocator_alloc(allocator, size);
+}
+
+// The arena hands out exactly what was asked for. The rest of the block is left for
+// other allocations rather then given to whoever happens to ask first.
+size_t arena_allocator_good_size(Allocator *allocator, size_t size) {
+    (void)allocator;
+    return size;
+}
+
+
+// The block allocator hands whole blocks to child arenas. Blocks given back by children
+// are kept in the free_blocks cache, and reused for any later request they are large
+// enough for. Only when nothing in the cache fits do we go to our own backing allocator.
+void *arena_allocator_block_alloc(Allocator *allocator, size_t size) {
+    ArenaAllocator *arena_allocator = (ArenaAllocator*)container_of(allocator, ArenaAllocator, block_allocator);
+
+    ArenaBlock **link = &arena_allocator->free_blocks;
+    while (NULL != *link) {
+        ArenaBlock *block = *link;
+        if (block->length >= size) {
+            *link = block->next;
+            block->next = NULL;
+            return block + 1;
+        }
+        link = &block->next;
+    }
+
+    return arena_allocator_block_create(arena_allocator, size);
+}
+
+void arena_allocator_block_free(Allocator *allocator, void *ptr) {
+    ArenaAllocator *arena_allocator = (ArenaAllocator*)container_of(allocator, ArenaAllocator, block_allocator);
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    ArenaBlock *block = (ArenaBlock*)ptr - 1;
+    block->next = arena_allocator->free_blocks;
+    arena_allocator->free_blocks = block;
+}
+
+void *arena_allocator_block_realloc(Allocator *allocator, void *old_ptr, size_t size) {
+    if (NULL != old_ptr) {
+        ArenaBlock *old_block = (ArenaBlock*)old_ptr - 1;
+        if (old_block->length >= size) {
+            return old_ptr;
+        }
+    }
+
+    void *new_ptr = arena_allocator_block_alloc(allocator, size);
+    if ((NULL != new_ptr) && (NULL != old_ptr)) {
+        memcpy(new_ptr, old_ptr, ((ArenaBlock*)old_ptr - 1)->length);
+        arena_allocator_block_free(allocator, old_ptr);
+    }
+
+    return new_ptr;
+}
+
+size_t arena_allocator_block_good_size(Allocator *allocator, size_t size) {
+    (void)allocator;
+    return size;
+}
+
+
+/* Arena Purger */
+ArenaPurger arena_purger_create(uint64_t decay_ms, size_t retain, bool lazy) {
+    int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+    if (lazy) {
+        advice = MADV_FREE;
+    }
+#endif
+
+    return (ArenaPurger){
+        PTHREAD_MUTEX_INITIALIZER,
+        NULL,
+        decay_ms * 1000000ull,
+        retain,
+        advice,
+        0,
+        0,
+        false,
+        0,
+    };
+}
+
+void arena_purger_destroy(ArenaPurger *purger) {
+    arena_purger_stop(purger);
+
+    // detach any arenas that are still registered.
+    pthread_mutex_lock(&purger->lock);
+    while (NULL != purger->arenas) {
+        ArenaAllocator *arena_allocator = purger->arenas;
+        purger->arenas = arena_allocator->purge_next;
+
+        arena_allocator_wake(arena_allocator);
+        arena_allocator->purger = NULL;
+        arena_allocator->purge_next = NULL;
+    }
+    pthread_mutex_unlock(&purger->lock);
+
+    pthread_mutex_destroy(&purger->lock);
+}
+
+// Registering should be done by the thread that uses the arena, before or between uses.
+void arena_purger_register(ArenaPurger *purger, ArenaAllocator *arena_allocator) {
+    assert(NULL == arena_allocator->purger);
+
+    pthread_mutex_lock(&purger->lock);
+    arena_allocator->purger = purger;
+    arena_allocator->purge_next = purger->arenas;
+    purger->arenas = arena_allocator;
+    pthread_mutex_unlock(&purger->lock);
+}
+
+void arena_purger_unregister(ArenaPurger *purger, ArenaAllocator *arena_allocator) {
+    pthread_mutex_lock(&purger->lock);
+
+    // taking the lock means the purger is not currently working on this arena.
+    ArenaAllocator **link = &purger->arenas;
+    while (NULL != *link && *link != arena_allocator) {
+        link = &(*link)->purge_next;
+    }
+    if (NULL != *link) {
+        *link = arena_allocator->purge_next;
+    }
+
+    atomic_store_explicit(&arena_allocator->state, ARENA_ACTIVE, memory_order_release);
+    arena_allocator->purger = NULL;
+    arena_allocator->purge_next = NULL;
+
+    pthread_mutex_unlock(&purger->lock);
+}
+
+// Release the pages of a single arena if it has been idle for long enough. Only
+// whole pages between the retained prefix and the end of the touched memory are
+// released, as the pages at the edges of the block may be shared with other
+// allocations from the backing allocator.
+static size_t arena_purger_purge(ArenaPurger *purger, ArenaAllocator *arena_allocator, uint64_t now) {
+    int expected = ARENA_IDLE;
+    if (!atomic_compare_exchange_strong_explicit(&arena_allocator->state, &expected, ARENA_PURGING,
+                                                 memory_order_acq_rel, memory_order_relaxed)) {
+        // the arena is in use.
+        return 0;
+    }
+
+    size_t purged = 0;
+    if ((NULL != arena_allocator->memory) && (now - arena_allocator->idle_since >= purger->decay)) {
+        uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+        size_t keep = purger->retain;
+        if (keep < arena_allocator->count) {
+            keep = arena_allocator->count;
+        }
+
+        size_t dirty = arena_allocator->dirty;
+        if (dirty > arena_allocator->length) {
+            dirty = arena_allocator->length;
+        }
+
+        uintptr_t start = ((uintptr_t)arena_allocator->memory + keep + page_size - 1) & ~(page_size - 1);
+        uintptr_t end = ((uintptr_t)arena_allocator->memory + dirty) & ~(page_size - 1);
+
+        if ((end > start) && (0 == madvise((void*)start, end - start, purger->advice))) {
+            purged = end - start;
+            arena_allocator->dirty = start - (uintptr_t)arena_allocator->memory;
+        }
+    }
+
+    atomic_store_explicit(&arena_allocator->state, ARENA_IDLE, memory_order_release);
+
+    return purged;
+}
+
+// Purge every registered arena that has decayed, returning the number of bytes released.
+size_t arena_purger_tick(ArenaPurger *purger) {
+    uint64_t now = arena_purger_now();
+    size_t purged = 0;
+
+    pthread_mutex_lock(&purger->lock);
+    for (ArenaAllocator *arena_allocator = purger->arenas; NULL != arena_allocator; arena_allocator = arena_allocator->purge_next) {
+        purged += arena_purger_purge(purger, arena_allocator, now);
+    }
+    pthread_mutex_unlock(&purger->lock);
+
+    atomic_fetch_add(&purger->purged, purged);
+
+    return purged;
+}
+
+static void *arena_purger_thread(void *arg) {
+    ArenaPurger *purger = (ArenaPurger*)arg;
+
+    struct timespec interval = {
+        (time_t)(purger->interval / 1000000000ull),
+        (long)(purger->interval % 1000000000ull),
+    };
+
+    while (atomic_load(&purger->running)) {
+        arena_purger_tick(purger);
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+// Start a background thread which ticks the purger every interval_ms milliseconds.
+bool arena_purger_start(ArenaPurger *purger, uint64_t interval_ms) {
+    assert(!atomic_load(&purger->running));
+
+    purger->interval = interval_ms * 1000000ull;
+    atomic_store(&purger->running, true);
+    if (0 != pthread_create(&purger->thread, NULL, arena_purger_thread, purger)) {
+        atomic_store(&purger->running, false);
+        return false;
+    }
+
+    return true;
+}
+
+void arena_purger_stop(ArenaPurger *purger) {
+    if (atomic_exchange(&purger->running, false)) {
+        pthread_join(purger->thread, NULL);
+    }
+}
+
+
+/* Adaptive Arena */
+AdaptiveArena adaptive_arena_create(Allocator *backing_allocator, uint32_t percentile) {
+    assert(0 < percentile && percentile <= 100);
+
+    return (AdaptiveArena){ arena_allocator_create(backing_allocator), { 0 }, 0, percentile, 0 };
+}
+
+void adaptive_arena_destroy(AdaptiveArena *adaptive_arena) {
+    arena_allocator_destroy(&adaptive_arena->arena);
+}
+
+// Reset the arena for the next generation, freeing all of its allocations. The peak usage
+// of the generation that just ended is recorded, and the arena's block is resized to the
+// learned size if it is far from it.
+void adaptive_arena_reset(AdaptiveArena *adaptive_arena) {
+    ArenaAllocator *arena_allocator = &adaptive_arena->arena;
+
+    // the block may be freed below, so the purger must not be releasing its pages.
+    // Clearing the arena at the end hands it back to the purger.
+    if (NULL != arena_allocator->purger) {
+        arena_allocator_wake(arena_allocator);
+    }
+
+    // the count only grows between resets, so it is the peak of this generation.
+    adaptive_arena->peaks[adaptive_arena->generations % ADAPTIVE_ARENA_HISTORY] = arena_allocator->count;
+    adaptive_arena->generations++;
+
+    // sort the recent peaks and pick the percentile from them. The history is small,
+    // so an insertion sort is plenty.
+    uint32_t num_peaks = adaptive_arena->generations;
+    if (num_peaks > ADAPTIVE_ARENA_HISTORY) {
+        num_peaks = ADAPTIVE_ARENA_HISTORY;
+    }
+
+    size_t sorted[ADAPTIVE_ARENA_HISTORY];
+    for (uint32_t index = 0; index < num_peaks; index++) {
+        size_t peak = adaptive_arena->peaks[index];
+        uint32_t position = index;
+        while (position > 0 && sorted[position - 1] > peak) {
+            sorted[position] = sorted[position - 1];
+            position--;
+        }
+        sorted[position] = peak;
+    }
+
+    uint32_t rank = (num_peaks * adaptive_arena->percentile + 99) / 100;
+    adaptive_arena->learned = sorted[rank - 1];
+
+    // Resize the block while the arena is empty, so nothing needs to be copied. The block
+    // is only shrunk if it is much larger then needed, to avoid churning on small changes.
+    size_t learned = adaptive_arena->learned;
+    if ((learned > arena_allocator->length) ||
+        ((NULL != arena_allocator->memory) && (learned < arena_allocator->length / 2))) {
+        Allocator *backing_allocator = arena_allocator->backing_allocator;
+
+        if (NULL != arena_allocator->memory) {
+            backing_allocator->free(backing_allocator, (ArenaBlock*)arena_allocator->memory - 1);
+            arena_allocator->memory = NULL;
+            arena_allocator->length = 0;
+        }
+
+        if (learned > 0) {
+            arena_allocator->memory = arena_allocator_block_create(arena_allocator, learned);
+            if (NULL != arena_allocator->memory) {
+                arena_allocator->length = learned;
+            }
+        }
+
+        arena_allocator->count = 0;
+        arena_allocator->dirty = 0;
+    }
+
+    arena_allocator_clear(arena_allocator);
+}
+
+size_t adaptive_arena_learned_size(AdaptiveArena *adaptive_arena) {
+    return adaptive_arena->learned;
+}
+
+
+/* Bump Allocator */
+BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory) {
+    Allocator allocator = (Allocator){ bump_allocator_alloc, bump_allocator_free, bump_allocator_realloc, bump_allocator_good_size };
+    return (BumpAllocator){ allocator, memory, 0, capacity };
+}
+
+void bump_allocator_destroy(BumpAllocator *bump_allocator) {
+    if (NULL != bump_allocator->memory) {
+        bump_allocator->memory = NULL;
+    }
+}
+
+void *bump_allocator_alloc(Allocator *allocator, size_t size) {
+    BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
+
+    char *ptr = NULL;
+    // compare against the remaining space, so a huge size can't overflow the count, and
+    // so the whole block can be used.
+    if (size <= (bump_allocator->length - bump_allocator->count)) {
         ptr = &bump_allocator->memory[bump_allocator->count];
         bump_allocator->count += size;
     }
@@ -366,9 +2115,1134 @@ void *bump_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size) {
     return bump_allocator->allocator.alloc(&bump_allocator->allocator, size);
 }
 
+// As with the arena, the bump allocator gives exactly the size asked for.
+size_t bump_allocator_good_size(Allocator *allocator, size_t size) {
+    (void)allocator;
+    return size;
+}
+
 // Free the whole allocation at once.
 void *bump_allocator_free_all(Allocator *allocator) {
     BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
     bump_allocator->count = 0;
 }
 
+
+/* Per-CPU Allocator */
+PerCpuAllocator per_cpu_allocator_create(Allocator *backing_allocator) {
+    Allocator allocator = (Allocator){ per_cpu_allocator_alloc, per_cpu_allocator_free, per_cpu_allocator_realloc, per_cpu_allocator_good_size };
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+
+    size_t align = _Alignof(PerCpuShard);
+    void *shard_memory = backing_allocator->alloc(backing_allocator, sizeof(PerCpuShard) * num_cpus + align - 1);
+    PerCpuShard *shards = NULL;
+    if (NULL != shard_memory) {
+        shards = (PerCpuShard*)(((uintptr_t)shard_memory + align - 1) & ~(uintptr_t)(align - 1));
+    } else {
+        num_cpus = 0;
+    }
+
+    for (long index = 0; index < num_cpus; index++) {
+        atomic_flag_clear(&shards[index].lock);
+        for (int size_class = 0; size_class < PER_CPU_CLASSES; size_class++) {
+            shards[index].free[size_class] = NULL;
+            shards[index].count[size_class] = 0;
+        }
+    }
+
+    return (PerCpuAllocator){ allocator, backing_allocator, shards, (uint32_t)num_cpus, shard_memory };
+}
+
+// Destroying the allocator returns all cached blocks to the backing allocator. No other
+// thread may be using the allocator at this point.
+void per_cpu_allocator_destroy(PerCpuAllocator *per_cpu_allocator) {
+    Allocator *backing_allocator = per_cpu_allocator->backing_allocator;
+
+    if (NULL == per_cpu_allocator->shards) {
+        return;
+    }
+
+    for (uint32_t index = 0; index < per_cpu_allocator->num_shards; index++) {
+        PerCpuShard *shard = &per_cpu_allocator->shards[index];
+        for (int size_class = 0; size_class < PER_CPU_CLASSES; size_class++) {
+            while (NULL != shard->free[size_class]) {
+                PerCpuBlock *block = shard->free[size_class];
+                shard->free[size_class] = block->next;
+                backing_allocator->free(backing_allocator, (PerCpuHeader*)block - 1);
+            }
+        }
+    }
+
+    backing_allocator->free(backing_allocator, per_cpu_allocator->shard_memory);
+    per_cpu_allocator->shards = NULL;
+    per_cpu_allocator->shard_memory = NULL;
+}
+
+// Find the smallest size class that fits the given size, or PER_CPU_CLASSES if it is
+// too large to be cached.
+static size_t per_cpu_allocator_size_class(size_t size) {
+    size_t size_class = 0;
+    while ((size_class < PER_CPU_CLASSES) && ((size_t)16 << size_class) < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+// Lock the shard of the CPU we are running on. If we migrate after looking up the CPU,
+// we may end up sharing a shard with another thread for a moment, which the lock handles.
+static PerCpuShard *per_cpu_allocator_lock_shard(PerCpuAllocator *per_cpu_allocator) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+
+    PerCpuShard *shard = &per_cpu_allocator->shards[(uint32_t)cpu % per_cpu_allocator->num_shards];
+    while (atomic_flag_test_and_set_explicit(&shard->lock, memory_order_acquire)) {
+        sched_yield();
+    }
+
+    return shard;
+}
+
+static void per_cpu_allocator_unlock_shard(PerCpuShard *shard) {
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+}
+
+void *per_cpu_allocator_alloc(Allocator *allocator, size_t size) {
+    PerCpuAllocator *per_cpu_allocator = (PerCpuAllocator*)container_of(allocator, PerCpuAllocator, allocator);
+    Allocator *backing_allocator = per_cpu_allocator->backing_allocator;
+
+    size_t size_class = per_cpu_allocator_size_class(size);
+    if (0 == per_cpu_allocator->num_shards) {
+        size_class = PER_CPU_CLASSES;
+    }
+
+    PerCpuHeader *header = NULL;
+    if (size_class < PER_CPU_CLASSES) {
+        PerCpuShard *shard = per_cpu_allocator_lock_shard(per_cpu_allocator);
+        PerCpuBlock *block = shard->free[size_class];
+        if (NULL != block) {
+            shard->free[size_class] = block->next;
+            shard->count[size_class]--;
+        }
+        per_cpu_allocator_unlock_shard(shard);
+
+        if (NULL != block) {
+            header = (PerCpuHeader*)block - 1;
+        } else {
+            // allocate the whole size class, so the block can be reused for any size in it.
+            header = backing_allocator->alloc(backing_allocator, sizeof(PerCpuHeader) + ((size_t)16 << size_class));
+        }
+    } else {
+        header = backing_allocator->alloc(backing_allocator, sizeof(PerCpuHeader) + size);
+    }
+
+    if (NULL == header) {
+        return NULL;
+    }
+
+    header->size_class = size_class;
+    header->size = size;
+
+    return header + 1;
+}
+
+void per_cpu_allocator_free(Allocator *allocator, void *ptr) {
+    PerCpuAllocator *per_cpu_allocator = (PerCpuAllocator*)container_of(allocator, PerCpuAllocator, allocator);
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    PerCpuHeader *header = (PerCpuHeader*)ptr - 1;
+    size_t size_class = header->size_class;
+
+    if ((size_class < PER_CPU_CLASSES) && (0 < per_cpu_allocator->num_shards)) {
+        PerCpuShard *shard = per_cpu_allocator_lock_shard(per_cpu_allocator);
+        bool cached = shard->count[size_class] < PER_CPU_CACHE_LENGTH;
+        if (cached) {
+            PerCpuBlock *block = (PerCpuBlock*)ptr;
+            block->next = shard->free[size_class];
+            shard->free[size_class] = block;
+            shard->count[size_class]++;
+        }
+        per_cpu_allocator_unlock_shard(shard);
+
+        if (cached) {
+            return;
+        }
+    }
+
+    per_cpu_allocator->backing_allocator->free(per_cpu_allocator->backing_allocator, header);
+}
+
+void *per_cpu_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    if (NULL == old_ptr) {
+        return per_cpu_allocator_alloc(allocator, new_size);
+    }
+
+    // if the block's size class still fits the new size, there is nothing to do.
+    PerCpuHeader *header = (PerCpuHeader*)old_ptr - 1;
+    if ((header->size_class < PER_CPU_CLASSES) &&
+        (per_cpu_allocator_size_class(new_size) == header->size_class)) {
+        header->size = new_size;
+        return old_ptr;
+    }
+
+    void *new_ptr = per_cpu_allocator_alloc(allocator, new_size);
+    if (NULL == new_ptr) {
+        return NULL;
+    }
+
+    size_t copy_size = header->size < new_size ? header->size : new_size;
+    memcpy(new_ptr, old_ptr, copy_size);
+    per_cpu_allocator_free(allocator, old_ptr);
+
+    return new_ptr;
+}
+
+// Cached sizes are rounded up to their size class.
+size_t per_cpu_allocator_good_size(Allocator *allocator, size_t size) {
+    PerCpuAllocator *per_cpu_allocator = (PerCpuAllocator*)container_of(allocator, PerCpuAllocator, allocator);
+    Allocator *backing_allocator = per_cpu_allocator->backing_allocator;
+
+    size_t size_class = per_cpu_allocator_size_class(size);
+    if (size_class < PER_CPU_CLASSES) {
+        return (size_t)16 << size_class;
+    }
+
+    return backing_allocator->good_size(backing_allocator, sizeof(PerCpuHeader) + size) - sizeof(PerCpuHeader);
+}
+
+
+/* Epoch Allocator */
+// Every allocation is given a header with its size, so realloc knows how much to copy.
+typedef struct EpochHeader {
+    size_t size;
+    size_t padding;
+} EpochHeader;
+
+// Called when a registered thread exits, making its record available to another thread.
+static void epoch_allocator_thread_exit(void *arg) {
+    EpochThread *thread = (EpochThread*)arg;
+    atomic_store(&thread->active, false);
+    atomic_store(&thread->in_use, false);
+}
+
+EpochAllocator epoch_allocator_create(Allocator *backing_allocator) {
+    Allocator allocator = (Allocator){ epoch_allocator_alloc, epoch_allocator_free, epoch_allocator_realloc, epoch_allocator_good_size };
+
+    // the key is filled in by pthread_key_create.
+    EpochAllocator epoch_allocator = (EpochAllocator){ allocator, backing_allocator, 0, NULL, 0 };
+    int result = pthread_key_create(&epoch_allocator.key, epoch_allocator_thread_exit);
+    assert(0 == result);
+
+    return epoch_allocator;
+}
+
+static void epoch_allocator_free_list(EpochAllocator *epoch_allocator, EpochRetireList *list) {
+    Allocator *backing_allocator = epoch_allocator->backing_allocator;
+    for (size_t index = 0; index < list->count; index++) {
+        backing_allocator->free(backing_allocator, list->ptrs[index]);
+    }
+    list->count = 0;
+}
+
+// Destroying the allocator frees everything that was retired. No thread may be using
+// the allocator, or any pointer retired through it, at this point.
+void epoch_allocator_destroy(EpochAllocator *epoch_allocator) {
+    Allocator *backing_allocator = epoch_allocator->backing_allocator;
+
+    pthread_key_delete(epoch_allocator->key);
+
+    EpochThread *thread = atomic_load(&epoch_allocator->threads);
+    while (NULL != thread) {
+        EpochThread *next = thread->next;
+        for (int index = 0; index < 3; index++) {
+            epoch_allocator_free_list(epoch_allocator, &thread->retired[index]);
+            backing_allocator->free(backing_allocator, thread->retired[index].ptrs);
+        }
+        backing_allocator->free(backing_allocator, thread);
+        thread = next;
+    }
+    atomic_store(&epoch_allocator->threads, NULL);
+}
+
+// Get the calling thread's record, registering the thread on first use.
+static EpochThread *epoch_allocator_thread(EpochAllocator *epoch_allocator) {
+    EpochThread *thread = pthread_getspecific(epoch_allocator->key);
+    if (NULL != thread) {
+        return thread;
+    }
+
+    // reuse the record of a thread which has exited, if there is one.
+    for (thread = atomic_load(&epoch_allocator->threads); NULL != thread; thread = thread->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&thread->in_use, &expected, true)) {
+            break;
+        }
+    }
+
+    if (NULL == thread) {
+        Allocator *backing_allocator = epoch_allocator->backing_allocator;
+        thread = backing_allocator->alloc(backing_allocator, sizeof(EpochThread));
+        assert(NULL != thread);
+        memset(thread, 0, sizeof(EpochThread));
+        atomic_store(&thread->in_use, true);
+
+        thread->next = atomic_load(&epoch_allocator->threads);
+        while (!atomic_compare_exchange_weak(&epoch_allocator->threads, &thread->next, thread)) {
+        }
+    }
+
+    pthread_setspecific(epoch_allocator->key, thread);
+
+    return thread;
+}
+
+// Enter a read-side critical section. Any pointer loaded from a shared structure inside
+// the section stays valid until the matching epoch_allocator_exit. Sections can nest.
+void epoch_allocator_enter(EpochAllocator *epoch_allocator) {
+    EpochThread *thread = epoch_allocator_thread(epoch_allocator);
+
+    if (0 == thread->depth++) {
+        atomic_store(&thread->active, true);
+        atomic_store(&thread->epoch, atomic_load(&epoch_allocator->epoch));
+    }
+}
+
+void epoch_allocator_exit(EpochAllocator *epoch_allocator) {
+    EpochThread *thread = epoch_allocator_thread(epoch_allocator);
+
+    assert(0 < thread->depth);
+    if (0 == --thread->depth) {
+        atomic_store(&thread->active, false);
+    }
+}
+
+// Move the global epoch forward, which is only possible once every thread in a critical
+// section has seen the current epoch.
+bool epoch_allocator_try_advance(EpochAllocator *epoch_allocator) {
+    uint_fast64_t epoch = atomic_load(&epoch_allocator->epoch);
+
+    for (EpochThread *thread = atomic_load(&epoch_allocator->threads); NULL != thread; thread = thread->next) {
+        if (atomic_load(&thread->active) && (atomic_load(&thread->epoch) != epoch)) {
+            return false;
+        }
+    }
+
+    return atomic_compare_exchange_strong(&epoch_allocator->epoch, &epoch, epoch + 1);
+}
+
+// Free the calling thread's retired pointers which are two or more epochs old.
+static size_t epoch_allocator_collect_thread(EpochAllocator *epoch_allocator, EpochThread *thread) {
+    uint_fast64_t epoch = atomic_load(&epoch_allocator->epoch);
+
+    size_t freed = 0;
+    for (int index = 0; index < 3; index++) {
+        EpochRetireList *list = &thread->retired[index];
+        if ((0 < list->count) && (list->epoch + 2 <= epoch)) {
+            freed += list->count;
+            epoch_allocator_free_list(epoch_allocator, list);
+        }
+    }
+
+    return freed;
+}
+
+// Try to advance the epoch and free whatever the calling thread can, returning the number
+// of pointers freed.
+size_t epoch_allocator_collect(EpochAllocator *epoch_allocator) {
+    EpochThread *thread = epoch_allocator_thread(epoch_allocator);
+
+    epoch_allocator_try_advance(epoch_allocator);
+    epoch_allocator_try_advance(epoch_allocator);
+
+    return epoch_allocator_collect_thread(epoch_allocator, thread);
+}
+
+// The number of pointers retired by the calling thread that have not been freed yet.
+size_t epoch_allocator_pending(EpochAllocator *epoch_allocator) {
+    EpochThread *thread = epoch_allocator_thread(epoch_allocator);
+
+    return thread->retired[0].count + thread->retired[1].count + thread->retired[2].count;
+}
+
+void *epoch_allocator_alloc(Allocator *allocator, size_t size) {
+    EpochAllocator *epoch_allocator = (EpochAllocator*)container_of(allocator, EpochAllocator, allocator);
+    Allocator *backing_allocator = epoch_allocator->backing_allocator;
+
+    EpochHeader *header = backing_allocator->alloc(backing_allocator, sizeof(EpochHeader) + size);
+    if (NULL == header) {
+        return NULL;
+    }
+    header->size = size;
+
+    return header + 1;
+}
+
+// Freeing retires the pointer into the calling thread's list for the current epoch.
+void epoch_allocator_free(Allocator *allocator, void *ptr) {
+    EpochAllocator *epoch_allocator = (EpochAllocator*)container_of(allocator, EpochAllocator, allocator);
+    Allocator *backing_allocator = epoch_allocator->backing_allocator;
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    EpochThread *thread = epoch_allocator_thread(epoch_allocator);
+    uint_fast64_t epoch = atomic_load(&epoch_allocator->epoch);
+    EpochRetireList *list = &thread->retired[epoch % 3];
+
+    // a list left over from three or more epochs ago is safe to free before reusing it.
+    if ((0 < list->count) && (list->epoch != epoch)) {
+        epoch_allocator_free_list(epoch_allocator, list);
+    }
+    list->epoch = epoch;
+
+    if (list->count == list->length) {
+        size_t new_length = list->length == 0 ? EPOCH_RETIRE_BATCH : list->length * 2;
+        void **ptrs = backing_allocator->realloc(backing_allocator, list->ptrs, new_length * sizeof(void*));
+        if (NULL == ptrs) {
+            // NOTE we can't free the pointer right away, so it is leaked.
+            return;
+        }
+        list->ptrs = ptrs;
+        list->length = new_length;
+    }
+
+    list->ptrs[list->count] = (EpochHeader*)ptr - 1;
+    list->count++;
+
+    // free in batches, so the cost of scanning the threads is spread over many frees.
+    if (0 == list->count % EPOCH_RETIRE_BATCH) {
+        epoch_allocator_try_advance(epoch_allocator);
+        epoch_allocator_collect_thread(epoch_allocator, thread);
+    }
+}
+
+// Reallocating always moves the memory, as other threads may still be reading the old block.
+void *epoch_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    void *new_ptr = epoch_allocator_alloc(allocator, new_size);
+    if ((NULL == new_ptr) || (NULL == old_ptr)) {
+        return new_ptr;
+    }
+
+    EpochHeader *header = (EpochHeader*)old_ptr - 1;
+    size_t copy_size = header->size < new_size ? header->size : new_size;
+    memcpy(new_ptr, old_ptr, copy_size);
+    epoch_allocator_free(allocator, old_ptr);
+
+    return new_ptr;
+}
+
+size_t epoch_allocator_good_size(Allocator *allocator, size_t size) {
+    EpochAllocator *epoch_allocator = (EpochAllocator*)container_of(allocator, EpochAllocator, allocator);
+    Allocator *backing_allocator = epoch_allocator->backing_allocator;
+
+    return backing_allocator->good_size(backing_allocator, sizeof(EpochHeader) + size) - sizeof(EpochHeader);
+}
+
+
+/* Snapshot Arena */
+// The capacity is fixed, as the arena's address has to stay the same across snapshots.
+// If the memfd can't be created, the arena has no memory and every allocation fails.
+SnapshotArena snapshot_arena_create(size_t capacity) {
+    Allocator allocator = (Allocator){ snapshot_arena_alloc, snapshot_arena_free, snapshot_arena_realloc, snapshot_arena_good_size };
+    SnapshotArena snapshot_arena = (SnapshotArena){ allocator, -1, NULL, 0, 0, false, NULL };
+
+    int fd = memfd_create("snapshot_arena", MFD_CLOEXEC);
+    if (fd < 0) {
+        return snapshot_arena;
+    }
+
+    if (0 != ftruncate(fd, (off_t)capacity)) {
+        close(fd);
+        return snapshot_arena;
+    }
+
+    void *memory = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == memory) {
+        close(fd);
+        return snapshot_arena;
+    }
+
+    snapshot_arena.fd = fd;
+    snapshot_arena.memory = memory;
+    snapshot_arena.length = capacity;
+
+    return snapshot_arena;
+}
+
+void snapshot_arena_destroy(SnapshotArena *snapshot_arena) {
+    if (NULL != snapshot_arena->memory) {
+        munmap(snapshot_arena->memory, snapshot_arena->length);
+        close(snapshot_arena->fd);
+
+        // any snapshots left keep their own count.
+        snapshot_arena->memory = NULL;
+        snapshot_arena->fd = -1;
+        snapshot_arena->refs = NULL;
+    }
+}
+
+// Map the given file copy-on-write over the arena's memory, in place.
+static bool snapshot_arena_map_private(SnapshotArena *snapshot_arena, int fd) {
+    void *memory = mmap(snapshot_arena->memory, snapshot_arena->length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, 0);
+    return MAP_FAILED != memory;
+}
+
+// Map the arena's file shared over its memory again, once no snapshot refers to the file.
+// The pages the arena copied since it was frozen are written back to the file first.
+static bool snapshot_arena_unfreeze(SnapshotArena *snapshot_arena) {
+    if ((ssize_t)snapshot_arena->count != pwrite(snapshot_arena->fd, snapshot_arena->memory, snapshot_arena->count, 0)) {
+        return false;
+    }
+
+    void *memory = mmap(snapshot_arena->memory, snapshot_arena->length, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, snapshot_arena->fd, 0);
+    return MAP_FAILED != memory;
+}
+
+// Take a snapshot of the arena. If the snapshot can't be taken, its memory is NULL.
+ArenaSnapshot snapshot_arena_snapshot(SnapshotArena *snapshot_arena) {
+    ArenaSnapshot snapshot = (ArenaSnapshot){ -1, NULL, 0, 0, NULL };
+
+    if (NULL == snapshot_arena->memory) {
+        return snapshot;
+    }
+
+    // if the current file is frozen, the arena's contents have to go into a new file.
+    int fd = snapshot_arena->fd;
+    if (snapshot_arena->frozen) {
+        fd = memfd_create("snapshot_arena", MFD_CLOEXEC);
+        if (fd < 0) {
+            return snapshot;
+        }
+
+        if ((0 != ftruncate(fd, (off_t)snapshot_arena->length)) ||
+            ((ssize_t)snapshot_arena->count != pwrite(fd, snapshot_arena->memory, snapshot_arena->count, 0))) {
+            close(fd);
+            return snapshot;
+        }
+    }
+
+    // either way no snapshot refers to the file yet, so it gets a new count.
+    uint32_t *refs = malloc(sizeof(uint32_t));
+    int snapshot_fd = dup(fd);
+    void *memory = mmap(NULL, snapshot_arena->length, PROT_READ, MAP_SHARED, fd, 0);
+
+    // from here on the arena writes to its own copies of the pages, leaving the file alone.
+    if ((NULL == refs) || (snapshot_fd < 0) || (MAP_FAILED == memory) ||
+        !snapshot_arena_map_private(snapshot_arena, fd)) {
+        free(refs);
+        if (0 <= snapshot_fd) {
+            close(snapshot_fd);
+        }
+        if (MAP_FAILED != memory) {
+            munmap(memory, snapshot_arena->length);
+        }
+        if (fd != snapshot_arena->fd) {
+            close(fd);
+        }
+        return snapshot;
+    }
+
+    if (fd != snapshot_arena->fd) {
+        close(snapshot_arena->fd);
+        snapshot_arena->fd = fd;
+    }
+    *refs = 1;
+    snapshot_arena->refs = refs;
+    snapshot_arena->frozen = true;
+
+    snapshot.fd = snapshot_fd;
+    snapshot.memory = memory;
+    snapshot.count = snapshot_arena->count;
+    snapshot.length = snapshot_arena->length;
+    snapshot.refs = refs;
+
+    return snapshot;
+}
+
+// Restore the arena to the contents it had when the snapshot was taken. The snapshot
+// stays valid, and can be restored again later.
+bool snapshot_arena_restore(SnapshotArena *snapshot_arena, ArenaSnapshot *snapshot) {
+    assert(snapshot->length == snapshot_arena->length);
+
+    int fd = dup(snapshot->fd);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!snapshot_arena_map_private(snapshot_arena, fd)) {
+        close(fd);
+        return false;
+    }
+
+    // the arena now shares the snapshot's file, and stays frozen while the snapshot is alive.
+    close(snapshot_arena->fd);
+    snapshot_arena->fd = fd;
+    snapshot_arena->count = snapshot->count;
+    snapshot_arena->frozen = true;
+    snapshot_arena->refs = snapshot->refs;
+
+    return true;
+}
+
+void *snapshot_arena_alloc(Allocator *allocator, size_t size) {
+    SnapshotArena *snapshot_arena = (SnapshotArena*)container_of(allocator, SnapshotArena, allocator);
+
+    // the arena can't grow without moving, so running out of room is a failed allocation.
+    if (size > snapshot_arena->length - snapshot_arena->count) {
+        return NULL;
+    }
+
+    uint8_t *ptr = &snapshot_arena->memory[snapshot_arena->count];
+    snapshot_arena->count += size;
+
+    return ptr;
+}
+
+void snapshot_arena_free(Allocator *allocator, void *ptr) {
+    // as with the arena, we free all at once or not at all.
+    (void)allocator;
+    (void)ptr;
+}
+
+void *snapshot_arena_realloc(Allocator *allocator, void *old_ptr, size_t size) {
+    // just allocate at the end, like a normal allocation.
+    (void)old_ptr;
+    return snapshot_arena_alloc(allocator, size);
+}
+
+size_t snapshot_arena_good_size(Allocator *allocator, size_t size) {
+    (void)allocator;
+    return size;
+}
+
+// Release a snapshot of the given arena. If it was the last snapshot of the arena's
+// file, the arena stops copying pages on write.
+void arena_snapshot_release(ArenaSnapshot *snapshot, SnapshotArena *snapshot_arena) {
+    if (NULL != snapshot->memory) {
+        munmap((void*)snapshot->memory, snapshot->length);
+        close(snapshot->fd);
+
+        (*snapshot->refs)--;
+        if (0 == *snapshot->refs) {
+            // if the arena can't be unfrozen it stays frozen, which is always safe.
+            if (snapshot->refs == snapshot_arena->refs) {
+                snapshot_arena->refs = NULL;
+                snapshot_arena->frozen = !snapshot_arena_unfreeze(snapshot_arena);
+            }
+            free(snapshot->refs);
+        }
+
+        snapshot->memory = NULL;
+        snapshot->fd = -1;
+        snapshot->refs = NULL;
+    }
+}
+
+// Translate a pointer into the arena to the same location in the snapshot's view.
+const void *arena_snapshot_ptr(ArenaSnapshot *snapshot, SnapshotArena *snapshot_arena, void *ptr) {
+    if (NULL == ptr) {
+        return NULL;
+    }
+
+    size_t offset = (uint8_t*)ptr - snapshot_arena->memory;
+    assert(offset < snapshot->length);
+
+    return &snapshot->memory[offset];
+}
+
+
+/* Stack Pool */
+StackPool stack_pool_create(size_t stack_size, size_t guard_pages, size_t max_free, bool lazy) {
+    Allocator allocator = (Allocator){ stack_pool_alloc, stack_pool_free, stack_pool_realloc, stack_pool_good_size };
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+    return (StackPool){ allocator, stack_size, guard_pages * page_size, lazy, NULL, 0, max_free };
+}
+
+void stack_pool_destroy(StackPool *stack_pool) {
+    while (NULL != stack_pool->free_stacks) {
+        void *stack = stack_pool->free_stacks;
+        stack_pool->free_stacks = *(void**)stack;
+        munmap((uint8_t*)stack - stack_pool->guard_size, stack_pool->guard_size + stack_pool->stack_size);
+    }
+    stack_pool->free_count = 0;
+}
+
+// Get a stack from the pool, mapping a new one if the pool is empty. The returned pointer
+// is the lowest address of the stack- stacks grow down, so execution starts at
+// stack + stack_size. Returns NULL if a new stack can't be mapped.
+void *stack_pool_acquire(StackPool *stack_pool) {
+    if (NULL != stack_pool->free_stacks) {
+        void *stack = stack_pool->free_stacks;
+        stack_pool->free_stacks = *(void**)stack;
+        stack_pool->free_count--;
+        return stack;
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (!stack_pool->lazy) {
+        flags |= MAP_POPULATE;
+    }
+
+    size_t mapped = stack_pool->guard_size + stack_pool->stack_size;
+    uint8_t *mapping = mmap(NULL, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (MAP_FAILED == mapping) {
+        return NULL;
+    }
+
+    // the guard pages sit below the stack, where an overflow would run into them.
+    if ((0 < stack_pool->guard_size) && (0 != mprotect(mapping, stack_pool->guard_size, PROT_NONE))) {
+        munmap(mapping, mapped);
+        return NULL;
+    }
+
+    return mapping + stack_pool->guard_size;
+}
+
+// Return a stack to the pool. The stack's contents are not kept.
+void stack_pool_release(StackPool *stack_pool, void *stack) {
+    if (NULL == stack) {
+        return;
+    }
+
+    if (stack_pool->free_count >= stack_pool->max_free) {
+        munmap((uint8_t*)stack - stack_pool->guard_size, stack_pool->guard_size + stack_pool->stack_size);
+        return;
+    }
+
+    *(void**)stack = stack_pool->free_stacks;
+    stack_pool->free_stacks = stack;
+    stack_pool->free_count++;
+}
+
+void *stack_pool_alloc(Allocator *allocator, size_t size) {
+    StackPool *stack_pool = (StackPool*)container_of(allocator, StackPool, allocator);
+
+    if (size > stack_pool->stack_size) {
+        return NULL;
+    }
+
+    return stack_pool_acquire(stack_pool);
+}
+
+void stack_pool_free(Allocator *allocator, void *ptr) {
+    StackPool *stack_pool = (StackPool*)container_of(allocator, StackPool, allocator);
+    stack_pool_release(stack_pool, ptr);
+}
+
+// Every stack is the same size, so a realloc either fits in place or fails.
+void *stack_pool_realloc(Allocator *allocator, void *old_ptr, size_t size) {
+    StackPool *stack_pool = (StackPool*)container_of(allocator, StackPool, allocator);
+
+    if (size > stack_pool->stack_size) {
+        return NULL;
+    }
+
+    if (NULL == old_ptr) {
+        return stack_pool_acquire(stack_pool);
+    }
+
+    return old_ptr;
+}
+
+// Anything that fits in a stack gets the whole stack.
+size_t stack_pool_good_size(Allocator *allocator, size_t size) {
+    StackPool *stack_pool = (StackPool*)container_of(allocator, StackPool, allocator);
+
+    if (size > stack_pool->stack_size) {
+        return size;
+    }
+
+    return stack_pool->stack_size;
+}
+
+
+/* Stats Region */
+// Create the statistics file at the given path (usually in /dev/shm) with room for the
+// given number of slots. If the file can't be created, the region's header is NULL.
+StatsRegion stats_region_create(const char *path, uint32_t num_slots) {
+    StatsRegion stats_region = (StatsRegion){ NULL, NULL, 0, { 0 } };
+
+    size_t length = sizeof(StatsHeader) + sizeof(StatsSlot) * num_slots;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return stats_region;
+    }
+
+    if (0 != ftruncate(fd, (off_t)length)) {
+        close(fd);
+        unlink(path);
+        return stats_region;
+    }
+
+    void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == memory) {
+        unlink(path);
+        return stats_region;
+    }
+
+    // the file starts out zeroed, so only the header needs filling in.
+    StatsHeader *header = (StatsHeader*)memory;
+    header->version = STATS_VERSION;
+    header->num_slots = num_slots;
+    header->pid = (uint64_t)getpid();
+    atomic_store(&header->used_slots, 0);
+
+    // the magic goes in last, so a reader never sees a half written header as valid.
+    atomic_thread_fence(memory_order_release);
+    header->magic = STATS_MAGIC;
+
+    stats_region.header = header;
+    stats_region.slots = (StatsSlot*)(header + 1);
+    stats_region.length = length;
+    snprintf(stats_region.path, sizeof(stats_region.path), "%s", path);
+
+    return stats_region;
+}
+
+// Unmap and remove the statistics file. Any slots handed out are no longer valid.
+void stats_region_destroy(StatsRegion *stats_region) {
+    if (NULL != stats_region->header) {
+        munmap(stats_region->header, stats_region->length);
+        unlink(stats_region->path);
+
+        stats_region->header = NULL;
+        stats_region->slots = NULL;
+    }
+}
+
+// Claim the next free slot, giving it a name for readers to show. Returns NULL if the
+// region is full. Slots are claimed by one thread at a time.
+StatsSlot *stats_region_slot(StatsRegion *stats_region, const char *name) {
+    StatsHeader *header = stats_region->header;
+
+    unsigned int index = atomic_load(&header->used_slots);
+    if (index >= header->num_slots) {
+        return NULL;
+    }
+
+    StatsSlot *slot = &stats_region->slots[index];
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+
+    // publish the slot only once its name is written.
+    atomic_store_explicit(&header->used_slots, index + 1, memory_order_release);
+
+    return slot;
+}
+
+
+/* Stats Allocator */
+typedef struct StatsHeaderBlock {
+    size_t size;
+    size_t padding;
+} StatsHeaderBlock;
+
+StatsAllocator stats_allocator_create(Allocator *backing_allocator, StatsSlot *slot) {
+    Allocator allocator = (Allocator){ stats_allocator_alloc, stats_allocator_free, stats_allocator_realloc, stats_allocator_good_size };
+    return (StatsAllocator){ allocator, backing_allocator, slot };
+}
+
+// Record an arena's current count and length in a slot.
+void stats_allocator_sample_arena(StatsSlot *slot, ArenaAllocator *arena_allocator) {
+    atomic_store_explicit(&slot->arena_count, arena_allocator->count, memory_order_relaxed);
+    atomic_store_explicit(&slot->arena_length, arena_allocator->length, memory_order_relaxed);
+}
+
+static void stats_allocator_add_bytes(StatsSlot *slot, size_t size) {
+    uint_least64_t in_use = atomic_fetch_add_explicit(&slot->bytes_in_use, size, memory_order_relaxed) + size;
+
+    uint_least64_t peak = atomic_load_explicit(&slot->peak_bytes, memory_order_relaxed);
+    while ((in_use > peak) &&
+           !atomic_compare_exchange_weak_explicit(&slot->peak_bytes, &peak, in_use, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void *stats_allocator_alloc(Allocator *allocator, size_t size) {
+    StatsAllocator *stats_allocator = (StatsAllocator*)container_of(allocator, StatsAllocator, allocator);
+    Allocator *backing_allocator = stats_allocator->backing_allocator;
+
+    atomic_fetch_add_explicit(&stats_allocator->slot->alloc_calls, 1, memory_order_relaxed);
+
+    StatsHeaderBlock *header = backing_allocator->alloc(backing_allocator, sizeof(StatsHeaderBlock) + size);
+    if (NULL == header) {
+        return NULL;
+    }
+    header->size = size;
+
+    stats_allocator_add_bytes(stats_allocator->slot, size);
+
+    return header + 1;
+}
+
+void stats_allocator_free(Allocator *allocator, void *ptr) {
+    StatsAllocator *stats_allocator = (StatsAllocator*)container_of(allocator, StatsAllocator, allocator);
+    Allocator *backing_allocator = stats_allocator->backing_allocator;
+
+    atomic_fetch_add_explicit(&stats_allocator->slot->free_calls, 1, memory_order_relaxed);
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    StatsHeaderBlock *header = (StatsHeaderBlock*)ptr - 1;
+    atomic_fetch_sub_explicit(&stats_allocator->slot->bytes_in_use, header->size, memory_order_relaxed);
+
+    backing_allocator->free(backing_allocator, header);
+}
+
+void *stats_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    StatsAllocator *stats_allocator = (StatsAllocator*)container_of(allocator, StatsAllocator, allocator);
+    Allocator *backing_allocator = stats_allocator->backing_allocator;
+
+    atomic_fetch_add_explicit(&stats_allocator->slot->realloc_calls, 1, memory_order_relaxed);
+
+    StatsHeaderBlock *header = NULL;
+    size_t old_size = 0;
+    if (NULL != old_ptr) {
+        header = (StatsHeaderBlock*)old_ptr - 1;
+        old_size = header->size;
+    }
+
+    header = backing_allocator->realloc(backing_allocator, header, sizeof(StatsHeaderBlock) + new_size);
+    if (NULL == header) {
+        return NULL;
+    }
+    header->size = new_size;
+
+    atomic_fetch_sub_explicit(&stats_allocator->slot->bytes_in_use, old_size, memory_order_relaxed);
+    stats_allocator_add_bytes(stats_allocator->slot, new_size);
+
+    return header + 1;
+}
+
+size_t stats_allocator_good_size(Allocator *allocator, size_t size) {
+    StatsAllocator *stats_allocator = (StatsAllocator*)container_of(allocator, StatsAllocator, allocator);
+    Allocator *backing_allocator = stats_allocator->backing_allocator;
+
+    return backing_allocator->good_size(backing_allocator, sizeof(StatsHeaderBlock) + size) - sizeof(StatsHeaderBlock);
+}
+
+
+/* Sampling Allocator */
+SamplingAllocator sampling_allocator_create(Allocator *backing_allocator, size_t sample_rate) {
+    Allocator allocator = (Allocator){ sampling_allocator_alloc, sampling_allocator_free, sampling_allocator_realloc, sampling_allocator_good_size };
+
+    assert(0 < sample_rate);
+
+    return (SamplingAllocator){
+        allocator,
+        backing_allocator,
+        sample_rate,
+        (int64_t)sample_rate,
+        PTHREAD_MUTEX_INITIALIZER,
+        0x9E3779B97F4A7C15ull,
+        NULL,
+        0,
+        0,
+    };
+}
+
+void sampling_allocator_destroy(SamplingAllocator *sampling_allocator) {
+    if (NULL != sampling_allocator->sites) {
+        sampling_allocator->backing_allocator->free(sampling_allocator->backing_allocator, sampling_allocator->sites);
+        sampling_allocator->sites = NULL;
+        sampling_allocator->num_sites = 0;
+        sampling_allocator->capacity = 0;
+    }
+    pthread_mutex_destroy(&sampling_allocator->lock);
+}
+
+// Pick the distance to the next sample uniformly from 1 to twice the sample rate, so the
+// average distance is the sample rate.
+static int64_t sampling_allocator_next_distance(SamplingAllocator *sampling_allocator) {
+    // xorshift64, stepped with a compare and swap as several threads may be sampling.
+    uint64_t old_state = atomic_load_explicit(&sampling_allocator->random_state, memory_order_relaxed);
+    uint64_t x = 0;
+    do {
+        x = old_state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    } while (!atomic_compare_exchange_weak_explicit(&sampling_allocator->random_state, &old_state, x,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    return (int64_t)(1 + x % (2 * (uint64_t)sampling_allocator->sample_rate));
+}
+
+// Find the table entry for a call stack, or the empty entry where it belongs.
+static SampleSite *sampling_allocator_find(SampleSite *sites, size_t capacity, uint64_t hash, void **frames, uint32_t depth) {
+    size_t index = hash & (capacity - 1);
+    while (0 != sites[index].samples) {
+        SampleSite *site = &sites[index];
+        if ((site->hash == hash) && (site->depth == depth) && (0 == memcmp(site->frames, frames, depth * sizeof(void*)))) {
+            break;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return &sites[index];
+}
+
+// Grow the site table, keeping it at most half full. Returns false if there is no memory,
+// in which case samples are dropped.
+static bool sampling_allocator_grow(SamplingAllocator *sampling_allocator) {
+    Allocator *backing_allocator = sampling_allocator->backing_allocator;
+
+    size_t new_capacity = sampling_allocator->capacity == 0 ? 64 : sampling_allocator->capacity * 2;
+    SampleSite *new_sites = backing_allocator->alloc(backing_allocator, new_capacity * sizeof(SampleSite));
+    if (NULL == new_sites) {
+        return false;
+    }
+    memset(new_sites, 0, new_capacity * sizeof(SampleSite));
+
+    for (size_t index = 0; index < sampling_allocator->capacity; index++) {
+        SampleSite *site = &sampling_allocator->sites[index];
+        if (0 != site->samples) {
+            *sampling_allocator_find(new_sites, new_capacity, site->hash, site->frames, site->depth) = *site;
+        }
+    }
+
+    backing_allocator->free(backing_allocator, sampling_allocator->sites);
+    sampling_allocator->sites = new_sites;
+    sampling_allocator->capacity = new_capacity;
+
+    return true;
+}
+
+// Take a sample: record the current call stack, charging it the bytes the sample stands for.
+__attribute__((noinline)) static void sampling_allocator_sample(SamplingAllocator *sampling_allocator, size_t size) {
+    // skip this function and sampling_allocator_count.
+    void *frames[SAMPLE_MAX_DEPTH + 2];
+    int depth = backtrace(frames, SAMPLE_MAX_DEPTH + 2) - 2;
+    if (depth <= 0) {
+        return;
+    }
+
+    // FNV-1a over the frame addresses.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int index = 0; index < depth; index++) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[index + 2]) * 0x100000001b3ull;
+    }
+
+    if ((2 * (sampling_allocator->num_sites + 1) > sampling_allocator->capacity) &&
+        !sampling_allocator_grow(sampling_allocator)) {
+        return;
+    }
+
+    SampleSite *site = sampling_allocator_find(sampling_allocator->sites, sampling_allocator->capacity, hash, &frames[2], depth);
+    if (0 == site->samples) {
+        site->hash = hash;
+        site->depth = (uint32_t)depth;
+        memcpy(site->frames, &frames[2], depth * sizeof(void*));
+        sampling_allocator->num_sites++;
+    }
+
+    // an allocation larger then the sample rate is always sampled, and stands for itself.
+    site->samples++;
+    site->bytes += size > sampling_allocator->sample_rate ? size : sampling_allocator->sample_rate;
+}
+
+// Count allocated bytes towards the next sample, sampling if we reach it. Only the
+// allocation which takes the countdown past zero samples, and it is sampled once. An
+// allocation larger then the sample rate can take the countdown far below zero, so
+// distances are added until it is above zero again. That is done before locking the
+// table, so that other threads' allocations count towards the next sample rather then
+// being lost while the countdown sits below zero.
+__attribute__((noinline)) static void sampling_allocator_count(SamplingAllocator *sampling_allocator, size_t size) {
+    int64_t before = atomic_fetch_sub_explicit(&sampling_allocator->bytes_until_sample, (int64_t)size, memory_order_relaxed);
+    if ((before > 0) && (before <= (int64_t)size)) {
+        int64_t distance = 0;
+        do {
+            distance = sampling_allocator_next_distance(sampling_allocator);
+        } while (atomic_fetch_add_explicit(&sampling_allocator->bytes_until_sample, distance, memory_order_relaxed) + distance <= 0);
+
+        pthread_mutex_lock(&sampling_allocator->lock);
+        sampling_allocator_sample(sampling_allocator, size);
+        pthread_mutex_unlock(&sampling_allocator->lock);
+    }
+}
+
+// Write the sites out in the folded stack format- one line per site, with the frames from
+// the outermost call in, separated by semicolons, followed by the estimated bytes.
+void sampling_allocator_dump_folded(SamplingAllocator *sampling_allocator, FILE *file) {
+    pthread_mutex_lock(&sampling_allocator->lock);
+    for (size_t index = 0; index < sampling_allocator->capacity; index++) {
+        SampleSite *site = &sampling_allocator->sites[index];
+        if (0 == site->samples) {
+            continue;
+        }
+
+        char **symbols = backtrace_symbols(site->frames, (int)site->depth);
+
+        for (int frame = (int)site->depth - 1; frame >= 0; frame--) {
+            // symbols look like "binary(function+0x12) [0x1234]". Use the function name if
+            // there is one, and the address if not.
+            const char *name = NULL;
+            int name_length = 0;
+            if (NULL != symbols) {
+                const char *open = strchr(symbols[frame], '(');
+                if ((NULL != open) && ('+' != open[1]) && (')' != open[1])) {
+                    name = open + 1;
+                    name_length = (int)strcspn(name, "+)");
+                }
+            }
+
+            if (NULL != name) {
+                fprintf(file, "%.*s", name_length, name);
+            } else {
+                fprintf(file, "%p", site->frames[frame]);
+            }
+            fputc(frame > 0 ? ';' : ' ', file);
+        }
+
+        fprintf(file, "%llu\n", (unsigned long long)site->bytes);
+
+        free(symbols);
+    }
+    pthread_mutex_unlock(&sampling_allocator->lock);
+}
+
+void *sampling_allocator_alloc(Allocator *allocator, size_t size) {
+    SamplingAllocator *sampling_allocator = (SamplingAllocator*)container_of(allocator, SamplingAllocator, allocator);
+
+    sampling_allocator_count(sampling_allocator, size);
+
+    return sampling_allocator->backing_allocator->alloc(sampling_allocator->backing_allocator, size);
+}
+
+void sampling_allocator_free(Allocator *allocator, void *ptr) {
+    SamplingAllocator *sampling_allocator = (SamplingAllocator*)container_of(allocator, SamplingAllocator, allocator);
+
+    sampling_allocator->backing_allocator->free(sampling_allocator->backing_allocator, ptr);
+}
+
+// A realloc is counted like an allocation of the new size.
+void *sampling_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    SamplingAllocator *sampling_allocator = (SamplingAllocator*)container_of(allocator, SamplingAllocator, allocator);
+
+    sampling_allocator_count(sampling_allocator, new_size);
+
+    return sampling_allocator->backing_allocator->realloc(sampling_allocator->backing_allocator, old_ptr, new_size);
+}
+
+size_t sampling_allocator_good_size(Allocator *allocator, size_t size) {
+    SamplingAllocator *sampling_allocator = (SamplingAllocator*)container_of(allocator, SamplingAllocator, allocator);
+    Allocator *backing_allocator = sampling_allocator->backing_allocator;
+
+    return backing_allocator->good_size(backing_allocator, size);
+}
@@ -1,10 +1,17 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 
+#include <string.h>
 #include <assert.h>
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
 
 // Simple container_of implementation to get the containing structure
 // from a pointer to a struct's field.
@@ -13,6 +20,34 @@
 #endif
 
 
+// The Allocator trait and the heap allocator, copied from alloc.c so that this
+// file stays self contained. See alloc.c for the details.
+typedef struct Allocator Allocator;
+
+typedef void* (*AllocatorAlloc)(Allocator *allocator, size_t size);
+typedef void (*AllocatorFree)(Allocator *allocator, void *ptr);
+typedef void* (*AllocatorRealloc)(Allocator *allocator, void *old_ptr, size_t new_size);
+typedef size_t (*AllocatorGoodSize)(Allocator *allocator, size_t size);
+
+typedef struct Allocator {
+    AllocatorAlloc alloc;
+    AllocatorFree free;
+    AllocatorRealloc realloc;
+    AllocatorGoodSize good_size;
+} Allocator;
+
+typedef struct HeapAllocator {
+    Allocator allocator;
+} HeapAllocator;
+
+typedef struct BumpAllocator {
+    Allocator allocator;
+    uint8_t *memory;
+    size_t count;
+    size_t length;
+} BumpAllocator;
+
+
 // Intrusive iterator type to embed in your structs.
 typedef struct Iter Iter;
 
@@ -20,10 +55,29 @@ typedef struct Iter Iter;
 // pointer, and returns whether or not it had data to provide.
 typedef bool (*IterNext)(Iter *iter, void *result);
 
+// The iterator batch function IterNextBatch fills in up to max results in
+// the results array, and returns how many it provided. Providing fewer then
+// max results means the iterator is done.
+// This lets a caller pay for one indirect call per batch, rather then one per
+// element. It is optional- an iterator which leaves it NULL is batched by
+// calling next repeatedly (see iter_next_batch).
+typedef size_t (*IterNextBatch)(Iter *iter, void *results, size_t max);
+
+// The iterator size hint function IterSizeHint gives bounds on how many more
+// results the iterator will provide- at least lower, and at most upper, with
+// an upper bound of SIZE_MAX meaning there is no known bound. When the bounds
+// are equal the length is exact, and a collector can allocate all the space
+// it needs at once.
+// This is also optional- an iterator which leaves it NULL is treated as having
+// bounds of 0 and SIZE_MAX (see iter_size_hint).
+typedef void (*IterSizeHint)(Iter *iter, size_t *lower, size_t *upper);
+
 // The iterator type itself, with a field for each function that needs to
-// be implemented (only one in this case).
+// be implemented.
 typedef struct Iter {
     IterNext next;
+    IterNextBatch next_batch;
+    IterSizeHint size_hint;
 } Iter;
 
 // The Range type uses an iterator to provide a sequence of number from a starting
@@ -41,8 +95,11 @@ typedef struct List List;
 
 // The list type, with a pointer to the next node and a dummy data item as an
 // example.
+// The jump pointer points some distance further down the list, for the
+// PrefetchListIter to prefetch. It is NULL unless set by list_set_jumps.
 typedef struct List {
     List *next;
+    List *jump;
     int data;
 } List;
 
@@ -55,12 +112,759 @@ typedef struct ListIter {
 } ListIter;
 
 
+// The furthest ahead list_set_jumps can point a node's jump pointer.
+#define PREFETCH_MAX_DISTANCE 64
+
+// A list iterator which prefetches the node each node's jump pointer points to.
+// Walking a list is bound by the latency of loading each node, as the address
+// of a node is only known once the node before it has loaded. The jump pointers
+// give the address of nodes further ahead, so several loads can be in flight at
+// once, and by the time the walk reaches a node it should already be cached.
+// The distance is chosen with list_set_jumps. Prefetching never faults, so jump
+// pointers left stale by changing the list only cost a wasted prefetch.
+typedef struct PrefetchListIter {
+    Iter iter;
+    List *current;
+} PrefetchListIter;
+
+// The index that marks the end of a pool list, like a NULL next pointer.
+#define LIST_POOL_NONE 0xFFFFFFFFu
+
+// A node of a list kept in a ListPool. It links to the next node by its index
+// in the pool rather than by a pointer, so a node is 8 bytes, where a List node
+// with its next and jump pointers is 24.
+typedef struct PoolNode {
+    uint32_t next;
+    int data;
+} PoolNode;
+
+// A pool of list nodes in one array. Any number of lists can live in a pool.
+// Nothing in the pool is a pointer, so the whole pool can be moved, or written
+// to a file and read back, with a memcpy.
+typedef struct ListPool {
+    // the allocator the nodes array comes from.
+    Allocator *allocator;
+    PoolNode *nodes;
+    // count is the number of nodes ever used in the array.
+    uint32_t count;
+    // capacity is the number of nodes the array has room for.
+    uint32_t capacity;
+    // released nodes, linked through their next index, to reuse first.
+    uint32_t free_head;
+} ListPool;
+
+// The pool list iterator, which works like ListIter, providing a pointer to
+// each node. The pointers are only good until the pool next grows.
+typedef struct PoolListIter {
+    Iter iter;
+    const ListPool *pool;
+    uint32_t current;
+} PoolListIter;
+
+// The number of elements in an unrolled list node, chosen so that a node fills
+// a 64 byte cache line.
+#define UNROLLED_NODE_LENGTH 13
+
+typedef struct UnrolledNode UnrolledNode;
+
+// A node of an unrolled list, holding up to UNROLLED_NODE_LENGTH elements in
+// order, with a pointer to the next node.
+typedef struct UnrolledNode {
+    UnrolledNode *next;
+    uint32_t count;
+    int data[UNROLLED_NODE_LENGTH];
+} UnrolledNode;
+
+// The unrolled list holds the same data as a List, but stores an array of
+// elements in each node, so walking it takes one pointer chase, and likely one
+// cache miss, per node rather than per element.
+typedef struct UnrolledList {
+    // the allocator the nodes come from.
+    Allocator *allocator;
+    UnrolledNode *head;
+    UnrolledNode *tail;
+    // the total number of elements in all nodes.
+    size_t count;
+} UnrolledList;
+
+// The unrolled list iterator provides each element in turn.
+typedef struct UnrolledIter {
+    Iter iter;
+    UnrolledNode *current;
+    // the index of the next element within the current node.
+    uint32_t index;
+    // the number of elements left, for the size hint.
+    size_t remaining;
+} UnrolledIter;
+
+
+// Iterator adapters wrap another iterator, changing the sequence it provides.
+// Each adapter embeds Iter, so adapters can wrap each other to build up a
+// pipeline, such as a filter over a map over a range. They are plain structs,
+// so they can live on the stack, or be copied into memory from an Allocator
+// with iter_box.
+// Adapters that pass elements through need to know the elements' size, so
+// they can batch the iterator they wrap (see iter_next_batch).
+
+// The largest element an adapter can hold on to itself.
+#define ITER_ITEM_SIZE 64
+// The size of the buffer a MapIter reads batches of input elements into.
+#define ITER_SCRATCH_SIZE 1024
+
+// Map count input elements to count output elements. Working on arrays lets a
+// batch be mapped with one call, in a loop the compiler can vectorize.
+typedef void (*IterMapFn)(void *context, const void *inputs, void *outputs, size_t count);
+
+// Decide whether an element is kept by a FilterIter.
+typedef bool (*IterFilterFn)(void *context, const void *value);
+
+// Create the iterator a FlatMapIter runs for an element, in the given storage
+// (of ITER_ITEM_SIZE bytes), returning a pointer to its Iter. The iterator must
+// not point into the storage itself, as the FlatMapIter may be copied.
+typedef Iter *(*IterFlatMapFn)(void *context, const void *value, void *storage);
+
+// Map each element of the inner iterator through a function.
+typedef struct MapIter {
+    Iter iter;
+    Iter *inner;
+    size_t input_size;
+    size_t output_size;
+    IterMapFn fn;
+    void *context;
+    _Alignas(max_align_t) uint8_t scratch[ITER_SCRATCH_SIZE];
+} MapIter;
+
+// Keep only the elements of the inner iterator that pass a test.
+typedef struct FilterIter {
+    Iter iter;
+    Iter *inner;
+    size_t element_size;
+    IterFilterFn fn;
+    void *context;
+} FilterIter;
+
+// Provide at most a given number of elements of the inner iterator.
+typedef struct TakeIter {
+    Iter iter;
+    Iter *inner;
+    size_t element_size;
+    size_t remaining;
+} TakeIter;
+
+// Drop a given number of elements from the start of the inner iterator.
+typedef struct SkipIter {
+    Iter iter;
+    Iter *inner;
+    size_t element_size;
+    size_t skip;
+} SkipIter;
+
+// Step two iterators together, until either is done. Each result is a struct
+// with the first iterator's element at its start, and the second iterator's
+// element at second_offset.
+typedef struct ZipIter {
+    Iter iter;
+    Iter *first;
+    Iter *second;
+    size_t second_offset;
+} ZipIter;
+
+// Provide all the elements of one iterator, and then all of another.
+typedef struct ChainIter {
+    Iter iter;
+    Iter *first;
+    Iter *second;
+    size_t element_size;
+    bool first_done;
+} ChainIter;
+
+// Number the elements of the inner iterator. Each result is a struct with a
+// size_t index at its start and the element at value_offset.
+typedef struct EnumerateIter {
+    Iter iter;
+    Iter *inner;
+    size_t value_offset;
+    size_t index;
+} EnumerateIter;
+
+// Run an iterator for each element of the outer iterator, providing all of
+// their elements in turn.
+typedef struct FlatMapIter {
+    Iter iter;
+    Iter *outer;
+    IterFlatMapFn fn;
+    void *context;
+    // whether an iterator is being run, and where its Iter is in storage. This
+    // is an offset rather than a pointer, so the adapter can be copied.
+    bool running;
+    size_t current_offset;
+    _Alignas(max_align_t) uint8_t item[ITER_ITEM_SIZE];
+    _Alignas(max_align_t) uint8_t storage[ITER_ITEM_SIZE];
+} FlatMapIter;
+
+
+// Fused pipelines are the static form of an adapter pipeline over a Range.
+// A pipeline such as range | map(f) | filter(g) | sum is given to
+// ITER_FUSED_DEFINE as a list of stages, which expands into a function that
+// runs every stage inline inside a single for loop. With no function pointers
+// in the loop, the compiler can inline f and g into it.
+//
+// The stages work on one element at a time, named fused_value, which stays the
+// same type through the pipeline:
+//     ITER_FUSED_MAP(f)    replaces the element with f(element).
+//     ITER_FUSED_FILTER(g) drops the element unless g(element) is true.
+// A dropped element goes no further, so a filter can guard a later stage, such
+// as a map that divides by the element. The branch this takes per element keeps
+// GCC from vectorizing the loop, but there are still no calls in it.
+//
+// ITER_FUSED_DEFINE(name, type, stages) defines:
+//     bool name##_apply(type *fused_value)
+//         run the stages on one element, returning whether it was kept.
+//     FusedIter name##_create(uint32_t start, uint32_t end)
+//     bool name##_next(Iter *iter, void *value)
+//     size_t name##_next_batch(Iter *iter, void *values, size_t max)
+//         the same pipeline wrapped in the dynamic Iter trait, so it can be
+//         handed to code that takes an Iter, or wrapped by more adapters.
+// The tight loop itself is written with ITER_FUSED_FOLD.
+#define ITER_FUSED_MAP(f) *fused_value = f(*fused_value);
+#define ITER_FUSED_FILTER(g) if (!g(*fused_value)) { return false; }
+
+#define ITER_FUSED_DEFINE(name, type, stages) \
+    static inline bool name##_apply(type *fused_value) { \
+        stages \
+        return true; \
+    } \
+    \
+    static bool name##_next(Iter *iter, void *value) { \
+        FusedIter *fused = (FusedIter*)container_of(iter, FusedIter, iter); \
+        type *result = (type*)value; \
+        while (fused->current < fused->end) { \
+            *result = (type)fused->current++; \
+            if (name##_apply(result)) { \
+                return true; \
+            } \
+        } \
+        return false; \
+    } \
+    \
+    static size_t name##_next_batch(Iter *iter, void *values, size_t max) { \
+        FusedIter *fused = (FusedIter*)container_of(iter, FusedIter, iter); \
+        type *results = (type*)values; \
+        size_t count = 0; \
+        while ((count < max) && (fused->current < fused->end)) { \
+            results[count] = (type)fused->current++; \
+            count += name##_apply(&results[count]); \
+        } \
+        return count; \
+    } \
+    \
+    static inline FusedIter name##_create(uint32_t start, uint32_t end) { \
+        return (FusedIter){ { name##_next, name##_next_batch, fused_iter_size_hint }, start, end }; \
+    }
+
+// Run a fused pipeline over the range start..end, combining the elements it
+// keeps into accumulator with fold, which can be a function or a macro taking
+// the accumulator and an element. This is the Sum scan's loop, without any
+// calls through Iter or Scan.
+#define ITER_FUSED_FOLD(name, type, start, end, accumulator, fold) \
+    do { \
+        const uint32_t fused_end = (end); \
+        for (uint32_t fused_index = (start); fused_index < fused_end; fused_index++) { \
+            type fused_element = (type)fused_index; \
+            if (name##_apply(&fused_element)) { \
+                (accumulator) = fold((accumulator), fused_element); \
+            } \
+        } \
+    } while (0)
+
+// The state of a fused pipeline used through the Iter trait. Its functions are
+// generated by ITER_FUSED_DEFINE.
+typedef struct FusedIter {
+    Iter iter;
+    uint32_t current;
+    uint32_t end;
+} FusedIter;
+
+
+// The Vec type is a growable array of elements of any one size, with its memory
+// coming from an Allocator. Unlike a List, its elements are contiguous, so
+// walking it is a linear scan of memory.
+typedef struct Vec {
+    // the allocator the data array comes from.
+    Allocator *allocator;
+    // data is the array of elements.
+    uint8_t *data;
+    // element_size is the size of each element in bytes.
+    size_t element_size;
+    // count is the current number of elements.
+    size_t count;
+    // capacity is the number of elements the data array has room for.
+    size_t capacity;
+} Vec;
+
+// The Vec iterator provides copies of a Vec's elements in order, from index up
+// to, but not including, end.
+typedef struct VecIter {
+    Iter iter;
+    const Vec *vec;
+    size_t index;
+    size_t end;
+} VecIter;
+
+
+// The Table type is a struct-of-arrays container. Rather than storing records
+// one after another, it stores each field of the records in its own array- a
+// column. A pass that reads only a few fields then only touches the memory for
+// those fields, instead of pulling whole records through the cache.
+// Records are moved in and out of a table with table_scatter and table_gather,
+// given the offset of each column's field in the record struct.
+
+// The most columns a table can have.
+#define TABLE_MAX_COLUMNS 16
+
+typedef struct Table {
+    // the allocator the column arrays come from.
+    Allocator *allocator;
+    size_t column_count;
+    // the size of each column's elements.
+    size_t column_sizes[TABLE_MAX_COLUMNS];
+    uint8_t *columns[TABLE_MAX_COLUMNS];
+    // count is the number of rows.
+    size_t count;
+    // capacity is the number of rows the column arrays have room for.
+    size_t capacity;
+} Table;
+
+// A slice of some of a table's columns, covering count rows from row. Each
+// pointer is to the first of those rows in a column, so the slice can be
+// processed with plain loops over arrays.
+typedef struct ColumnSlice {
+    size_t row;
+    size_t count;
+    const void *columns[TABLE_MAX_COLUMNS];
+} ColumnSlice;
+
+// The column iterator provides a table's rows as ColumnSlices of up to
+// slice_length rows, for the chosen columns only.
+typedef struct ColumnIter {
+    Iter iter;
+    const Table *table;
+    size_t column_count;
+    size_t columns[TABLE_MAX_COLUMNS];
+    size_t slice_length;
+    size_t row;
+} ColumnIter;
+
+// Parallel iterators split a source that can be indexed, such as a Range or a
+// Vec, into chunks, and run a pipeline over each chunk on a pool of threads.
+// The elements of each chunk are combined with a reduction, and the results for
+// the chunks are then merged in order into a single result.
+
+// The most threads a parallel iterator will use.
+#define PAR_MAX_THREADS 64
+// Each thread takes a few chunks, so threads that finish early can pick up
+// work from ones that are slower.
+#define PAR_CHUNKS_PER_THREAD 4
+// The room each thread has to build its pipeline in.
+#define PAR_PIPELINE_SIZE 4096
+// The number of elements each thread folds at a time.
+#define PAR_BATCH_LENGTH 256
+
+typedef struct ParIter ParIter;
+
+// Create the iterator over the elements from start up to end of a parallel
+// iterator's source, in storage (of ITER_ITEM_SIZE bytes).
+typedef Iter *(*ParSplitFn)(const ParIter *par_iter, size_t start, size_t end, void *storage);
+
+// Build a pipeline over a chunk's iterator, in storage (of PAR_PIPELINE_SIZE
+// bytes), returning the iterator to reduce.
+typedef Iter *(*ParPipelineFn)(void *context, Iter *source, void *storage);
+
+// A reduction run by a parallel iterator. The accumulator can be up to
+// ITER_ITEM_SIZE bytes. Merging must be associative, but as chunks are merged in
+// order it doesn't need to be commutative.
+typedef struct ParReduce {
+    size_t accumulator_size;
+    // set an accumulator to the reduction's identity, such as 0 for a sum.
+    void (*identity)(void *context, void *accumulator);
+    // combine count elements into an accumulator.
+    void (*fold)(void *context, void *accumulator, const void *values, size_t count);
+    // combine the other accumulator into an accumulator.
+    void (*merge)(void *context, void *accumulator, const void *other);
+    void *context;
+} ParReduce;
+
+// A parallel iterator, with the source it splits and an optional pipeline to run
+// over each chunk.
+typedef struct ParIter {
+    ParSplitFn split;
+    // the source being split- a Vec, or NULL for a range.
+    const void *source;
+    // the offset of the first element, which is the start of a range.
+    size_t offset;
+    // the number of elements in the source.
+    size_t length;
+    ParPipelineFn pipeline;
+    void *pipeline_context;
+    // the size of the elements the pipeline provides.
+    size_t element_size;
+} ParIter;
+
+
+// The Scheduler is a work-stealing thread pool for fork/join parallelism. Each
+// worker has a deque of tasks. It pushes and pops tasks at the bottom of its
+// own deque, and when that is empty it steals from the top of the deque of a
+// randomly chosen worker. The oldest tasks, which are stolen, tend to be the
+// largest, so this balances work even when tasks take very different amounts
+// of time, which a fixed split into chunks can't do.
+//
+// A task forks children with scheduler_fork, and waits for them with
+// scheduler_join. While waiting, a worker runs other tasks rather than blocking.
+// Workers with nothing to do spin for a while looking for work, and then park
+// until a new task is forked.
+
+// The number of tasks a worker's deque can hold. Forking onto a full deque
+// runs the task immediately instead.
+#define WORK_DEQUE_LENGTH 1024
+
+typedef struct SchedulerWorker SchedulerWorker;
+typedef struct Task Task;
+
+// A task function, run on the given worker.
+typedef void (*TaskFn)(SchedulerWorker *worker, Task *task);
+
+// A task to run on a Scheduler. The task is usually embedded in a struct with
+// its arguments and results, which the task function gets with container_of.
+// A task must stay in place until it has been joined, so it often lives on the
+// stack of the task that forked it.
+typedef struct Task {
+    TaskFn fn;
+    atomic_bool done;
+} Task;
+
+// A Chase-Lev deque of tasks, in a fixed size ring. Only the worker that owns
+// the deque pushes and takes at the bottom, while any worker can steal from
+// the top.
+typedef struct WorkDeque {
+    _Alignas(64) atomic_llong top;
+    _Alignas(64) atomic_llong bottom;
+    _Atomic(Task*) tasks[WORK_DEQUE_LENGTH];
+} WorkDeque;
+
+typedef struct Scheduler Scheduler;
+
+typedef struct SchedulerWorker {
+    WorkDeque deque;
+    Scheduler *scheduler;
+    size_t index;
+    // the state of the xorshift generator used to pick workers to steal from.
+    uint32_t random;
+    // scratch memory for the tasks run on this worker, which is reset whenever
+    // the worker finishes a task it didn't run from inside another task.
+    BumpAllocator scratch;
+    pthread_t thread;
+} SchedulerWorker;
+
+typedef struct Scheduler {
+    // the allocator the workers and their scratch memory come from.
+    Allocator *allocator;
+    SchedulerWorker *workers;
+    // the allocator does not align to a cache line, as the deques need, so the
+    // workers are placed inside a larger block, which is kept here to free it.
+    void *worker_memory;
+    size_t worker_count;
+    size_t scratch_size;
+    // how many times an idle worker looks for work before parking.
+    uint32_t spin_rounds;
+    atomic_bool running;
+    // parked workers wait on wake, and the number waiting is kept in sleeping.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_size_t sleeping;
+} Scheduler;
+
+
+
+size_t iter_next_batch(Iter *iter, void *results, size_t element_size, size_t max);
+void iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+void *iter_box(Allocator *allocator, const void *adapter, size_t size);
+
+HeapAllocator heap_allocator_create(void);
+void *heap_allocator_alloc(Allocator *allocator, size_t size);
+void heap_allocator_free(Allocator *allocator, void *ptr);
+void *heap_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t heap_allocator_good_size(Allocator *allocator, size_t size);
+
+BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory);
+void *bump_allocator_alloc(Allocator *allocator, size_t size);
+void bump_allocator_free(Allocator *allocator, void *ptr);
+void *bump_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t bump_allocator_good_size(Allocator *allocator, size_t size);
+void bump_allocator_free_all(Allocator *allocator);
+
 Range range_create(uint32_t start, uint32_t end);
 bool range_next(Iter *iter, void *value);
+size_t range_next_batch(Iter *iter, void *values, size_t max);
+void range_size_hint(Iter *iter, size_t *lower, size_t *upper);
 
 List list_create(List *next, int data);
+List *list_compact(List *root, Allocator *allocator);
 ListIter list_iter_create(List *root);
 bool list_iter_next(Iter *iter, void *value);
+size_t list_iter_next_batch(Iter *iter, void *values, size_t max);
+
+ListPool list_pool_create(Allocator *allocator, uint32_t capacity);
+void list_pool_destroy(ListPool *pool);
+uint32_t list_pool_node(ListPool *pool, uint32_t next, int data);
+void list_pool_release(ListPool *pool, uint32_t index);
+PoolNode *list_pool_get(const ListPool *pool, uint32_t index);
+PoolListIter pool_list_iter_create(const ListPool *pool, uint32_t root);
+bool pool_list_iter_next(Iter *iter, void *value);
+size_t pool_list_iter_next_batch(Iter *iter, void *values, size_t max);
+
+void list_set_jumps(List *root, uint32_t distance);
+PrefetchListIter prefetch_list_iter_create(List *root);
+bool prefetch_list_iter_next(Iter *iter, void *value);
+size_t prefetch_list_iter_next_batch(Iter *iter, void *values, size_t max);
+
+UnrolledList unrolled_list_create(Allocator *allocator);
+void unrolled_list_destroy(UnrolledList *list);
+bool unrolled_list_push(UnrolledList *list, int data);
+bool unrolled_list_insert(UnrolledList *list, size_t index, int data);
+UnrolledNode *unrolled_list_split(UnrolledList *list, UnrolledNode *node);
+UnrolledIter unrolled_iter_create(const UnrolledList *list);
+bool unrolled_iter_next(Iter *iter, void *value);
+size_t unrolled_iter_next_batch(Iter *iter, void *values, size_t max);
+void unrolled_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+MapIter map_iter_create(Iter *inner, size_t input_size, size_t output_size, IterMapFn fn, void *context);
+bool map_iter_next(Iter *iter, void *value);
+size_t map_iter_next_batch(Iter *iter, void *values, size_t max);
+void map_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+FilterIter filter_iter_create(Iter *inner, size_t element_size, IterFilterFn fn, void *context);
+bool filter_iter_next(Iter *iter, void *value);
+size_t filter_iter_next_batch(Iter *iter, void *values, size_t max);
+void filter_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+TakeIter take_iter_create(Iter *inner, size_t element_size, size_t count);
+bool take_iter_next(Iter *iter, void *value);
+size_t take_iter_next_batch(Iter *iter, void *values, size_t max);
+void take_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+SkipIter skip_iter_create(Iter *inner, size_t element_size, size_t count);
+bool skip_iter_next(Iter *iter, void *value);
+size_t skip_iter_next_batch(Iter *iter, void *values, size_t max);
+void skip_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+ZipIter zip_iter_create(Iter *first, Iter *second, size_t second_offset);
+bool zip_iter_next(Iter *iter, void *value);
+void zip_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+ChainIter chain_iter_create(Iter *first, Iter *second, size_t element_size);
+bool chain_iter_next(Iter *iter, void *value);
+size_t chain_iter_next_batch(Iter *iter, void *values, size_t max);
+void chain_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+EnumerateIter enumerate_iter_create(Iter *inner, size_t value_offset);
+bool enumerate_iter_next(Iter *iter, void *value);
+void enumerate_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+FlatMapIter flat_map_iter_create(Iter *outer, IterFlatMapFn fn, void *context);
+bool flat_map_iter_next(Iter *iter, void *value);
+
+void fused_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+Vec vec_create(Allocator *allocator, size_t element_size, size_t capacity);
+void vec_destroy(Vec *vec);
+bool vec_reserve(Vec *vec, size_t additional);
+bool vec_push(Vec *vec, const void *value);
+void *vec_get(const Vec *vec, size_t index);
+bool vec_extend(Vec *vec, Iter *iter);
+Vec vec_collect(Iter *iter, size_t element_size, Allocator *allocator);
+
+VecIter vec_iter_create(const Vec *vec);
+VecIter vec_iter_slice(const Vec *vec, size_t start, size_t end);
+bool vec_iter_next(Iter *iter, void *value);
+size_t vec_iter_next_batch(Iter *iter, void *values, size_t max);
+void vec_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+Table table_create(Allocator *allocator, const size_t *column_sizes, size_t column_count);
+void table_destroy(Table *table);
+bool table_reserve(Table *table, size_t additional);
+void *table_column(const Table *table, size_t column);
+void table_scatter(Table *table, size_t row, const void *record, const size_t *offsets);
+void table_gather(const Table *table, size_t row, void *record, const size_t *offsets);
+bool table_push(Table *table, const void *record, const size_t *offsets);
+void table_gather_column(const Table *table, size_t column, const size_t *rows, size_t count, void *values);
+void table_scatter_column(Table *table, size_t column, const size_t *rows, size_t count, const void *values);
+ColumnIter column_iter_create(const Table *table, const size_t *columns, size_t column_count, size_t slice_length);
+bool column_iter_next(Iter *iter, void *value);
+void column_iter_size_hint(Iter *iter, size_t *lower, size_t *upper);
+
+ParIter par_iter_range(uint32_t start, uint32_t end);
+ParIter par_iter_vec(const Vec *vec);
+void par_iter_pipeline(ParIter *par_iter, ParPipelineFn pipeline, void *context, size_t element_size);
+void par_iter_reduce(const ParIter *par_iter, const ParReduce *reduce, size_t threads, void *result);
+Iter *par_range_split(const ParIter *par_iter, size_t start, size_t end, void *storage);
+Iter *par_vec_split(const ParIter *par_iter, size_t start, size_t end, void *storage);
+void par_iter_reduce_scheduler(Scheduler *scheduler, const ParIter *par_iter, const ParReduce *reduce,
+                               size_t grain, void *result);
+
+Task task_create(TaskFn fn);
+
+Scheduler scheduler_create(Allocator *allocator, size_t threads, size_t scratch_size, uint32_t spin_rounds);
+bool scheduler_start(Scheduler *scheduler);
+void scheduler_stop(Scheduler *scheduler);
+void scheduler_run(Scheduler *scheduler, Task *task);
+void scheduler_fork(SchedulerWorker *worker, Task *task);
+void scheduler_join(SchedulerWorker *worker, Task *task);
+Allocator *scheduler_scratch(SchedulerWorker *worker);
+size_t scheduler_scratch_mark(SchedulerWorker *worker);
+void scheduler_scratch_release(SchedulerWorker *worker, size_t mark);
+
+void work_deque_init(WorkDeque *deque);
+bool work_deque_push(WorkDeque *deque, Task *task);
+Task *work_deque_take(WorkDeque *deque);
+Task *work_deque_steal(WorkDeque *deque);
+
+// Functions used by the adapter tests.
+static void square(void *context, const void *inputs, void *outputs, size_t count) {
+    const uint32_t *input = (const uint32_t*)inputs;
+    uint32_t *output = (uint32_t*)outputs;
+    for (size_t index = 0; index < count; index++) {
+        output[index] = input[index] * input[index];
+    }
+}
+
+static bool is_even(void *context, const void *value) {
+    return 0 == *(const uint32_t*)value % 2;
+}
+
+static Iter *range_to(void *context, const void *value, void *storage) {
+    Range *range = (Range*)storage;
+    *range = range_create(0, *(const uint32_t*)value);
+    return &range->iter;
+}
+
+// A fused pipeline used by the fused pipeline test.
+static inline uint32_t square_one(uint32_t value) {
+    return value * value;
+}
+
+static inline bool is_even_one(uint32_t value) {
+    return 0 == value % 2;
+}
+
+#define ADD(accumulator, value) ((accumulator) + (value))
+
+ITER_FUSED_DEFINE(even_squares, uint32_t, ITER_FUSED_FILTER(is_even_one) ITER_FUSED_MAP(square_one))
+
+// A fused pipeline whose filter guards a map that would fault on the elements it drops.
+static inline bool is_nonzero_one(uint32_t value) {
+    return 0 != value;
+}
+
+static inline uint32_t divide_720_one(uint32_t value) {
+    return 720 / value;
+}
+
+ITER_FUSED_DEFINE(divisions, uint32_t, ITER_FUSED_FILTER(is_nonzero_one) ITER_FUSED_MAP(divide_720_one))
+
+// A sum of uint32_t elements into a uint64_t, used by the parallel iterator tests.
+static void sum_identity(void *context, void *accumulator) {
+    *(uint64_t*)accumulator = 0;
+}
+
+static void sum_fold(void *context, void *accumulator, const void *values, size_t count) {
+    const uint32_t *elements = (const uint32_t*)values;
+    uint64_t sum = *(uint64_t*)accumulator;
+    for (size_t index = 0; index < count; index++) {
+        sum += elements[index];
+    }
+    *(uint64_t*)accumulator = sum;
+}
+
+static void sum_merge(void *context, void *accumulator, const void *other) {
+    *(uint64_t*)accumulator += *(const uint64_t*)other;
+}
+
+typedef struct EvenSquares {
+    FilterIter evens;
+    MapIter squares;
+} EvenSquares;
+
+static Iter *even_squares_pipeline(void *context, Iter *source, void *storage) {
+    EvenSquares *pipeline = (EvenSquares*)storage;
+    pipeline->evens = filter_iter_create(source, sizeof(uint32_t), is_even, NULL);
+    pipeline->squares = map_iter_create(&pipeline->evens.iter, sizeof(uint32_t), sizeof(uint32_t), square, NULL);
+    return &pipeline->squares.iter;
+}
+
+// A fork/join Fibonacci, used by the scheduler test. The work is very uneven,
+// as one side of each fork is much larger than the other.
+typedef struct Fib {
+    Task task;
+    uint32_t n;
+    uint64_t result;
+} Fib;
+
+static void fib_task(SchedulerWorker *worker, Task *task) {
+    Fib *fib = (Fib*)container_of(task, Fib, task);
+
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+
+    // the children are kept in scratch memory rather than on the stack.
+    size_t mark = scheduler_scratch_mark(worker);
+    Allocator *scratch = scheduler_scratch(worker);
+    Fib *children = scratch->alloc(scratch, 2 * sizeof(Fib));
+    assert(NULL != children);
+    children[0] = (Fib){ task_create(fib_task), fib->n - 1, 0 };
+    children[1] = (Fib){ task_create(fib_task), fib->n - 2, 0 };
+
+    scheduler_fork(worker, &children[0].task);
+    children[1].task.fn(worker, &children[1].task);
+    scheduler_join(worker, &children[0].task);
+
+    fib->result = children[0].result + children[1].result;
+    scheduler_scratch_release(worker, mark);
+}
+
+// A wide record used by the table test, of which most passes read two fields.
+typedef struct Particle {
+    uint32_t id;
+    float x;
+    float y;
+    float z;
+    float vx;
+    float vy;
+    float vz;
+    float mass;
+    char name[32];
+} Particle;
+
+enum { PARTICLE_ID, PARTICLE_X, PARTICLE_Y, PARTICLE_Z, PARTICLE_VX, PARTICLE_VY, PARTICLE_VZ, PARTICLE_MASS,
+       PARTICLE_NAME, PARTICLE_COLUMNS };
+
+static const size_t particle_sizes[PARTICLE_COLUMNS] = {
+    sizeof(uint32_t), sizeof(float), sizeof(float), sizeof(float),
+    sizeof(float), sizeof(float), sizeof(float), sizeof(float), 32,
+};
+
+static const size_t particle_offsets[PARTICLE_COLUMNS] = {
+    offsetof(Particle, id), offsetof(Particle, x), offsetof(Particle, y), offsetof(Particle, z),
+    offsetof(Particle, vx), offsetof(Particle, vy), offsetof(Particle, vz), offsetof(Particle, mass),
+    offsetof(Particle, name),
+};
+
+static double seconds_now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
 
 int main(int argc, char *argv[]) {
     printf("\ncontainer_of test:\n");
@@ -130,60 +934,2702 @@ int main(int argc, char *argv[]) {
             printf("node data = %d\n", current_node->data);
         }
     }
-}
 
-// Create a new range given the initial and ending value.
-Range range_create(uint32_t start, uint32_t end) {
-    // the maximum uint32_t would cause an overflow of the iterator index.
-    assert(0xFFFFFFFF != end);
+    printf("\nbatches:\n");
+    {
+        // a range fills whole batches, and then what is left.
+        Range range = range_create(0, 1000);
+        uint32_t values[64];
+        uint32_t expected = 0;
 
-    return (Range){ { range_next }, start, end };
-}
+        size_t count = 0;
+        while ((count = iter_next_batch(&range.iter, values, sizeof(values[0]), 64)) > 0) {
+            for (size_t index = 0; index < count; index++) {
+                assert(values[index] == expected);
+                expected++;
+            }
+        }
+        assert(1000 == expected);
 
-// Range type iterator implementation.
-bool range_next(Iter *iter, void *value) {
-    Range *range = (Range*)container_of(iter, Range, iter);
+        // batches and single steps can be mixed.
+        range = range_create(0, 10);
+        uint32_t value = 0;
+        assert(range.iter.next(&range.iter, &value) && 0 == value);
+        assert(9 == iter_next_batch(&range.iter, values, sizeof(values[0]), 64));
+        assert(1 == values[0] && 9 == values[8]);
+        assert(0 == iter_next_batch(&range.iter, values, sizeof(values[0]), 64));
 
-    uint32_t *result = (uint32_t*)value;
+        // an iterator without its own batch function is batched through next.
+        range = range_create(5, 10);
+        range.iter.next_batch = NULL;
+        assert(3 == iter_next_batch(&range.iter, values, sizeof(values[0]), 3));
+        assert(5 == values[0] && 7 == values[2]);
+        assert(2 == iter_next_batch(&range.iter, values, sizeof(values[0]), 3));
+        assert(8 == values[0] && 9 == values[1]);
 
-    // update the iterator result with the current range value.
-    *result = range->current;
+        // a list is walked a batch of nodes at a time.
+        List third = list_create(NULL, 3);
+        List second = list_create(&third, 2);
+        List root = list_create(&second, 1);
+        ListIter list_iter = list_iter_create(&root);
 
-    // step to the next value.
-    range->current++;
+        List *nodes[2];
+        assert(2 == iter_next_batch(&list_iter.iter, nodes, sizeof(nodes[0]), 2));
+        assert(&root == nodes[0] && &second == nodes[1]);
+        assert(1 == iter_next_batch(&list_iter.iter, nodes, sizeof(nodes[0]), 2));
+        assert(&third == nodes[0]);
+        assert(0 == iter_next_batch(&list_iter.iter, nodes, sizeof(nodes[0]), 2));
 
-    // we are done only if we move past the range end.
-    return range->current <= range->end;
-}
+        printf("batches test passed\n");
+    }
 
-// Create a new list node given its next node in the
-// sequence, and the data that the node will contain.
-List list_create(List *next, int data) {
-    return (List){ next, data };
-}
+    printf("\nadapters:\n");
+    {
+        // the squares of the first five even numbers, one at a time.
+        Range range = range_create(0, 100);
+        FilterIter evens = filter_iter_create(&range.iter, sizeof(uint32_t), is_even, NULL);
+        MapIter squares = map_iter_create(&evens.iter, sizeof(uint32_t), sizeof(uint32_t), square, NULL);
+        TakeIter first_five = take_iter_create(&squares.iter, sizeof(uint32_t), 5);
 
-ListIter list_iter_create(List *root) {
-    return (ListIter){ { list_iter_next }, root };
-}
+        uint32_t expected[] = { 0, 4, 16, 36, 64 };
+        uint32_t value = 0;
+        size_t count = 0;
+        while (first_five.iter.next(&first_five.iter, &value)) {
+            assert(expected[count] == value);
+            count++;
+        }
+        assert(5 == count);
 
-// List type iterator implementation.
-bool list_iter_next(Iter *iter, void *value) {
-    ListIter *list_iter = (ListIter*)container_of(iter, ListIter, iter);
+        // the same pipeline in batches, skipping the first two.
+        range = range_create(0, 100);
+        evens = filter_iter_create(&range.iter, sizeof(uint32_t), is_even, NULL);
+        squares = map_iter_create(&evens.iter, sizeof(uint32_t), sizeof(uint32_t), square, NULL);
+        SkipIter skip = skip_iter_create(&squares.iter, sizeof(uint32_t), 2);
+        first_five = take_iter_create(&skip.iter, sizeof(uint32_t), 3);
 
-    List **result = (List**)value;
+        uint32_t values[16];
+        assert(3 == iter_next_batch(&first_five.iter, values, sizeof(values[0]), 16));
+        assert(16 == values[0] && 36 == values[1] && 64 == values[2]);
+        assert(0 == iter_next_batch(&first_five.iter, values, sizeof(values[0]), 16));
 
-    // the result is the current list node
-    *result = list_iter->current;
+        // taking nothing asks the skip for an empty batch, which it must not spin on.
+        range = range_create(0, 10);
+        skip = skip_iter_create(&range.iter, sizeof(uint32_t), 3);
+        TakeIter none = take_iter_create(&skip.iter, sizeof(uint32_t), 0);
+        assert(0 == iter_next_batch(&none.iter, values, sizeof(values[0]), 16));
 
-    // there are more nodes if the current node has a non-null link.
-    bool more_nodes = list_iter->current != NULL;
-    if (more_nodes) {
-        // move our current location in the list to the next node.
-        list_iter->current = list_iter->current->next;
+        // chain two ranges together.
+        Range low = range_create(0, 3);
+        Range high = range_create(10, 12);
+        ChainIter chain = chain_iter_create(&low.iter, &high.iter, sizeof(uint32_t));
+        assert(5 == iter_next_batch(&chain.iter, values, sizeof(values[0]), 16));
+        assert(2 == values[2] && 10 == values[3] && 11 == values[4]);
+
+        // zip a list with a range, numbering the pairs as we go.
+        typedef struct Pair {
+            List *node;
+            uint32_t number;
+        } Pair;
+        typedef struct Numbered {
+            size_t index;
+            Pair pair;
+        } Numbered;
+
+        List third = list_create(NULL, 3);
+        List second = list_create(&third, 2);
+        List root = list_create(&second, 1);
+        ListIter list_iter = list_iter_create(&root);
+        range = range_create(100, 200);
+        ZipIter zip = zip_iter_create(&list_iter.iter, &range.iter, offsetof(Pair, number));
+        EnumerateIter enumerate = enumerate_iter_create(&zip.iter, offsetof(Numbered, pair));
+
+        Numbered numbered;
+        count = 0;
+        while (enumerate.iter.next(&enumerate.iter, &numbered)) {
+            assert(count == numbered.index);
+            assert((int)count + 1 == numbered.pair.node->data);
+            assert(100 + count == numbered.pair.number);
+            count++;
+        }
+        assert(3 == count);
+
+        // flat map each number n to the range 0..n, boxing the adapter on the heap.
+        HeapAllocator heap_allocator = heap_allocator_create();
+        range = range_create(0, 4);
+        FlatMapIter flat_map_value = flat_map_iter_create(&range.iter, range_to, NULL);
+        FlatMapIter *flat_map = iter_box(&heap_allocator.allocator, &flat_map_value, sizeof(flat_map_value));
+        assert(NULL != flat_map);
+
+        uint32_t flat_expected[] = { 0, 0, 1, 0, 1, 2 };
+        assert(6 == iter_next_batch(&flat_map->iter, values, sizeof(values[0]), 16));
+        assert(0 == memcmp(flat_expected, values, sizeof(flat_expected)));
+        heap_allocator.allocator.free(&heap_allocator.allocator, flat_map);
+
+        // boxing a flat map part way through its inner iterator carries on where it was.
+        range = range_create(0, 4);
+        flat_map_value = flat_map_iter_create(&range.iter, range_to, NULL);
+        assert(2 == iter_next_batch(&flat_map_value.iter, values, sizeof(values[0]), 2));
+        flat_map = iter_box(&heap_allocator.allocator, &flat_map_value, sizeof(flat_map_value));
+        assert(NULL != flat_map);
+        memset(&flat_map_value, 0, sizeof(flat_map_value));
+        assert(4 == iter_next_batch(&flat_map->iter, &values[2], sizeof(values[0]), 16));
+        assert(0 == memcmp(flat_expected, values, sizeof(flat_expected)));
+        heap_allocator.allocator.free(&heap_allocator.allocator, flat_map);
+
+        // a batch bigger than the map's scratch buffer is still filled.
+        uint32_t squares_batch[512];
+        range = range_create(0, 1000);
+        squares = map_iter_create(&range.iter, sizeof(uint32_t), sizeof(uint32_t), square, NULL);
+        assert(512 == iter_next_batch(&squares.iter, squares_batch, sizeof(squares_batch[0]), 512));
+        assert(511 * 511 == squares_batch[511]);
+
+        printf("adapters test passed\n");
     }
 
-    // if the current node is NULL, we reached the end of the list,
-    // so stop the iteration.
-    return more_nodes;
-}
+    printf("\nfused pipelines:\n");
+    {
+        // the fused pipeline gives the same sum as the dynamic one.
+        const uint32_t end = 1000;
+
+        uint32_t fused_sum = 0;
+        ITER_FUSED_FOLD(even_squares, uint32_t, 0, end, fused_sum, ADD);
+
+        Range range = range_create(0, end);
+        FilterIter evens = filter_iter_create(&range.iter, sizeof(uint32_t), is_even, NULL);
+        MapIter squares = map_iter_create(&evens.iter, sizeof(uint32_t), sizeof(uint32_t), square, NULL);
+        uint32_t dynamic_sum = 0;
+        uint32_t value = 0;
+        while (squares.iter.next(&squares.iter, &value)) {
+            dynamic_sum += value;
+        }
+        assert(dynamic_sum == fused_sum);
+
+        // and through the Iter trait, one at a time and in batches.
+        FusedIter fused = even_squares_create(0, end);
+        uint32_t next_sum = 0;
+        while (fused.iter.next(&fused.iter, &value)) {
+            next_sum += value;
+        }
+        assert(next_sum == fused_sum);
+
+        fused = even_squares_create(0, end);
+        uint32_t values[64];
+        uint32_t batch_sum = 0;
+        size_t count = 0;
+        do {
+            count = iter_next_batch(&fused.iter, values, sizeof(values[0]), 64);
+            for (size_t index = 0; index < count; index++) {
+                batch_sum += values[index];
+            }
+        } while (count == 64);
+        assert(batch_sum == fused_sum);
+
+        // a fused pipeline can be wrapped by dynamic adapters.
+        fused = even_squares_create(0, end);
+        TakeIter take = take_iter_create(&fused.iter, sizeof(uint32_t), 3);
+        assert(3 == iter_next_batch(&take.iter, values, sizeof(values[0]), 64));
+        assert(0 == values[0] && 4 == values[1] && 16 == values[2]);
+
+        // a filter drops an element before the later stages see it, so it can guard a divide.
+        uint32_t division_sum = 0;
+        ITER_FUSED_FOLD(divisions, uint32_t, 0, 7, division_sum, ADD);
+        assert(720 + 360 + 240 + 180 + 144 + 120 == division_sum);
+
+        fused = divisions_create(0, 7);
+        assert(6 == iter_next_batch(&fused.iter, values, sizeof(values[0]), 64));
+        assert(720 == values[0] && 120 == values[5]);
+
+        printf("sum of even squares below %u = %u\n", end, fused_sum);
+        printf("fused pipelines test passed\n");
+    }
 
+    printf("\nsize hints:\n");
+    {
+        size_t lower = 0;
+        size_t upper = 0;
+
+        // a range is exact, and counts down as it is used.
+        Range range = range_create(10, 20);
+        iter_size_hint(&range.iter, &lower, &upper);
+        assert(10 == lower && 10 == upper);
+
+        uint32_t values[4];
+        iter_next_batch(&range.iter, values, sizeof(values[0]), 4);
+        iter_size_hint(&range.iter, &lower, &upper);
+        assert(6 == lower && 6 == upper);
+
+        uint32_t value = 0;
+        while (range.iter.next(&range.iter, &value)) { }
+        iter_size_hint(&range.iter, &lower, &upper);
+        assert(0 == lower && 0 == upper);
+
+        // a list iterator doesn't know its length.
+        List root = list_create(NULL, 1);
+        ListIter list_iter = list_iter_create(&root);
+        iter_size_hint(&list_iter.iter, &lower, &upper);
+        assert(0 == lower && SIZE_MAX == upper);
+
+        // adapters pass on what they know.
+        range = range_create(0, 100);
+        SkipIter skip = skip_iter_create(&range.iter, sizeof(uint32_t), 10);
+        TakeIter take = take_iter_create(&skip.iter, sizeof(uint32_t), 50);
+        iter_size_hint(&take.iter, &lower, &upper);
+        assert(50 == lower && 50 == upper);
+
+        range = range_create(0, 100);
+        FilterIter evens = filter_iter_create(&range.iter, sizeof(uint32_t), is_even, NULL);
+        iter_size_hint(&evens.iter, &lower, &upper);
+        assert(0 == lower && 100 == upper);
+
+        Range low = range_create(0, 3);
+        Range high = range_create(10, 15);
+        ChainIter chain = chain_iter_create(&low.iter, &high.iter, sizeof(uint32_t));
+        iter_size_hint(&chain.iter, &lower, &upper);
+        assert(8 == lower && 8 == upper);
+
+        list_iter = list_iter_create(&root);
+        range = range_create(0, 100);
+        ZipIter zip = zip_iter_create(&range.iter, &list_iter.iter, sizeof(uint32_t));
+        iter_size_hint(&zip.iter, &lower, &upper);
+        assert(0 == lower && 100 == upper);
+
+        FusedIter fused = even_squares_create(0, 100);
+        iter_size_hint(&fused.iter, &lower, &upper);
+        assert(0 == lower && 100 == upper);
+
+        printf("size hints test passed\n");
+    }
+
+    printf("\nvecs:\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        Allocator *allocator = &heap_allocator.allocator;
+
+        // a range knows its length, so it is collected with a single allocation.
+        Range range = range_create(0, 1000);
+        Vec numbers = vec_collect(&range.iter, sizeof(uint32_t), allocator);
+        assert(1000 == numbers.count);
+        assert(allocator->good_size(allocator, 1000 * sizeof(uint32_t)) / sizeof(uint32_t) == numbers.capacity);
+        for (uint32_t index = 0; index < numbers.count; index++) {
+            assert(index == *(uint32_t*)vec_get(&numbers, index));
+        }
+
+        // with an allocator that doesn't round sizes up, the range fills the vec exactly,
+        // and nothing more is allocated to find out that the range is done.
+        static _Alignas(max_align_t) uint8_t exact_memory[4 * 1000 * sizeof(uint32_t)];
+        BumpAllocator bump_allocator = bump_allocator_create(sizeof(exact_memory), exact_memory);
+        range = range_create(0, 1000);
+        Vec exact = vec_collect(&range.iter, sizeof(uint32_t), &bump_allocator.allocator);
+        assert(1000 == exact.count && 1000 == exact.capacity);
+        assert(1000 * sizeof(uint32_t) == bump_allocator.count);
+
+        // an iterator without an exact hint is checked for more before the vec grows.
+        Vec filtered = vec_create(allocator, sizeof(uint32_t), 1000);
+        size_t capacity = filtered.capacity;
+        range = range_create(0, 2 * (uint32_t)capacity);
+        FilterIter evens = filter_iter_create(&range.iter, sizeof(uint32_t), is_even, NULL);
+        assert(vec_extend(&filtered, &evens.iter));
+        assert(capacity == filtered.count && capacity == filtered.capacity);
+
+        // a list doesn't, so the vec grows as it goes.
+        List nodes[100];
+        for (int index = 0; index < 100; index++) {
+            nodes[index] = list_create(index + 1 < 100 ? &nodes[index + 1] : NULL, index);
+        }
+        ListIter list_iter = list_iter_create(&nodes[0]);
+        Vec list_nodes = vec_collect(&list_iter.iter, sizeof(List*), allocator);
+        assert(100 == list_nodes.count);
+        assert(&nodes[99] == *(List**)vec_get(&list_nodes, 99));
+
+        // a vec can be iterated, and adapted, like anything else.
+        VecIter vec_iter = vec_iter_create(&numbers);
+        evens = filter_iter_create(&vec_iter.iter, sizeof(uint32_t), is_even, NULL);
+        Vec even_numbers = vec_collect(&evens.iter, sizeof(uint32_t), allocator);
+        assert(500 == even_numbers.count);
+        assert(998 == *(uint32_t*)vec_get(&even_numbers, 499));
+
+        // pushing one at a time.
+        Vec pushed = vec_create(allocator, sizeof(uint32_t), 0);
+        for (uint32_t value = 0; value < 10; value++) {
+            assert(vec_push(&pushed, &value));
+        }
+        vec_iter = vec_iter_create(&pushed);
+        uint32_t value = 0;
+        uint32_t expected = 0;
+        while (vec_iter.iter.next(&vec_iter.iter, &value)) {
+            assert(expected == value);
+            expected++;
+        }
+        assert(10 == expected);
+
+        vec_destroy(&numbers);
+        vec_destroy(&list_nodes);
+        vec_destroy(&even_numbers);
+        vec_destroy(&pushed);
+        vec_destroy(&filtered);
+
+        printf("vecs test passed\n");
+    }
+
+    printf("\nparallel iterators:\n");
+    {
+        ParReduce sum = { sizeof(uint64_t), sum_identity, sum_fold, sum_merge, NULL };
+
+        // sum a range over several threads.
+        ParIter par_iter = par_iter_range(0, 100000);
+        uint64_t result = 0;
+        par_iter_reduce(&par_iter, &sum, 4, &result);
+        assert((uint64_t)99999 * 100000 / 2 == result);
+
+        // the same with a pipeline over each chunk.
+        par_iter_pipeline(&par_iter, even_squares_pipeline, NULL, sizeof(uint32_t));
+        par_iter_reduce(&par_iter, &sum, 3, &result);
+        uint64_t expected = 0;
+        for (uint64_t value = 0; value < 100000; value += 2) {
+            expected += (uint32_t)(value * value);
+        }
+        assert(expected == result);
+
+        // a vec, split into more chunks than it has elements.
+        HeapAllocator heap_allocator = heap_allocator_create();
+        Range range = range_create(1, 11);
+        Vec numbers = vec_collect(&range.iter, sizeof(uint32_t), &heap_allocator.allocator);
+        par_iter = par_iter_vec(&numbers);
+        par_iter_reduce(&par_iter, &sum, 8, &result);
+        assert(55 == result);
+        vec_destroy(&numbers);
+
+        // an empty range reduces to the identity.
+        par_iter = par_iter_range(5, 5);
+        par_iter_reduce(&par_iter, &sum, 4, &result);
+        assert(0 == result);
+
+        // how summing a large range scales with threads.
+        const uint32_t length = 1 << 26;
+        par_iter = par_iter_range(0, length);
+        for (size_t threads = 1; threads <= 8; threads *= 2) {
+            double start = seconds_now();
+            par_iter_reduce(&par_iter, &sum, threads, &result);
+            double elapsed = seconds_now() - start;
+            assert((uint64_t)(length - 1) * length / 2 == result);
+            printf("%zu threads: %.3f seconds\n", threads, elapsed);
+        }
+
+        printf("parallel iterators test passed\n");
+    }
+
+    printf("\nscheduler:\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        Scheduler scheduler = scheduler_create(&heap_allocator.allocator, 4, 64 * 1024, 64);
+        assert(scheduler_start(&scheduler));
+        assert(0 == (uintptr_t)scheduler.workers % _Alignof(SchedulerWorker));
+
+        // fork/join with uneven work.
+        Fib fib = { task_create(fib_task), 20, 0 };
+        scheduler_run(&scheduler, &fib.task);
+        assert(6765 == fib.result);
+
+        // the scheduler can be used again once a task is done.
+        fib = (Fib){ task_create(fib_task), 10, 0 };
+        scheduler_run(&scheduler, &fib.task);
+        assert(55 == fib.result);
+
+        // reduce a parallel iterator by splitting it in half until the pieces
+        // are small, letting idle workers steal the halves.
+        ParReduce sum = { sizeof(uint64_t), sum_identity, sum_fold, sum_merge, NULL };
+        ParIter par_iter = par_iter_range(0, 100000);
+        uint64_t result = 0;
+        par_iter_reduce_scheduler(&scheduler, &par_iter, &sum, 1000, &result);
+        assert((uint64_t)99999 * 100000 / 2 == result);
+
+        par_iter_pipeline(&par_iter, even_squares_pipeline, NULL, sizeof(uint32_t));
+        par_iter_reduce_scheduler(&scheduler, &par_iter, &sum, 1000, &result);
+        uint64_t expected = 0;
+        for (uint64_t value = 0; value < 100000; value += 2) {
+            expected += (uint32_t)(value * value);
+        }
+        assert(expected == result);
+
+        scheduler_stop(&scheduler);
+
+        // a scheduler with only the calling thread still works.
+        scheduler = scheduler_create(&heap_allocator.allocator, 1, 64 * 1024, 64);
+        assert(scheduler_start(&scheduler));
+        fib = (Fib){ task_create(fib_task), 15, 0 };
+        scheduler_run(&scheduler, &fib.task);
+        assert(610 == fib.result);
+        scheduler_stop(&scheduler);
+
+        // without room for the scratch memory, the scheduler doesn't start.
+        uint8_t memory[sizeof(SchedulerWorker) * 3];
+        BumpAllocator bump_allocator = bump_allocator_create(sizeof(memory), memory);
+        scheduler = scheduler_create(&bump_allocator.allocator, 2, 64 * 1024, 64);
+        assert(!scheduler_start(&scheduler));
+        assert(NULL == scheduler.workers);
+
+        printf("scheduler test passed\n");
+    }
+
+    printf("\nunrolled lists:\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        UnrolledList list = unrolled_list_create(&heap_allocator.allocator);
+
+        // pushing fills each node before starting the next.
+        for (int value = 0; value < 100; value++) {
+            assert(unrolled_list_push(&list, value * 2));
+        }
+        assert(100 == list.count);
+        assert(UNROLLED_NODE_LENGTH == list.head->count);
+
+        UnrolledIter unrolled_iter = unrolled_iter_create(&list);
+        int value = 0;
+        int expected = 0;
+        while (unrolled_iter.iter.next(&unrolled_iter.iter, &value)) {
+            assert(expected == value);
+            expected += 2;
+        }
+        assert(200 == expected);
+
+        // inserting the odd numbers into full nodes splits them.
+        for (int odd = 1; odd < 200; odd += 2) {
+            assert(unrolled_list_insert(&list, odd, odd));
+        }
+        assert(200 == list.count);
+
+        // splitting by hand moves the back half of a node to a new node.
+        UnrolledNode *head = list.head;
+        uint32_t head_count = head->count;
+        UnrolledNode *split = unrolled_list_split(&list, head);
+        assert(NULL != split && split == head->next);
+        assert(head_count == head->count + split->count);
+
+        // the batch iterator copies a node's elements at a time.
+        int values[64];
+        unrolled_iter = unrolled_iter_create(&list);
+        size_t lower = 0;
+        size_t upper = 0;
+        iter_size_hint(&unrolled_iter.iter, &lower, &upper);
+        assert(200 == lower && 200 == upper);
+
+        expected = 0;
+        size_t count = 0;
+        do {
+            count = iter_next_batch(&unrolled_iter.iter, values, sizeof(values[0]), 64);
+            for (size_t index = 0; index < count; index++) {
+                assert(expected == values[index]);
+                expected++;
+            }
+        } while (64 == count);
+        assert(200 == expected);
+
+        unrolled_list_destroy(&list);
+        assert(NULL == list.head && 0 == list.count);
+
+        printf("unrolled lists test passed\n");
+    }
+
+    printf("\nprefetching lists:\n");
+    {
+        // the prefetching iterator provides the same nodes as a ListIter,
+        // whatever the jump distance.
+        List nodes[100];
+        for (int index = 0; index < 100; index++) {
+            nodes[index] = list_create(index + 1 < 100 ? &nodes[index + 1] : NULL, index);
+        }
+
+        list_set_jumps(&nodes[0], 8);
+        assert(&nodes[8] == nodes[0].jump);
+        assert(&nodes[99] == nodes[91].jump);
+        assert(NULL == nodes[92].jump);
+
+        uint32_t distances[] = { 0, 1, 8, 1000 };
+        for (size_t which = 0; which < sizeof(distances) / sizeof(distances[0]); which++) {
+            list_set_jumps(&nodes[0], distances[which]);
+            PrefetchListIter prefetch_iter = prefetch_list_iter_create(&nodes[0]);
+            List *node = NULL;
+            int expected = 0;
+            while (prefetch_iter.iter.next(&prefetch_iter.iter, &node)) {
+                assert(&nodes[expected] == node);
+                expected++;
+            }
+            assert(100 == expected);
+        }
+
+        PrefetchListIter prefetch_iter = prefetch_list_iter_create(&nodes[0]);
+        List *batch[64];
+        assert(64 == iter_next_batch(&prefetch_iter.iter, batch, sizeof(batch[0]), 64));
+        assert(36 == iter_next_batch(&prefetch_iter.iter, batch, sizeof(batch[0]), 64));
+        assert(&nodes[99] == batch[35]);
+
+        // compare walking a long list scattered over a large block of memory.
+        const size_t length = 1 << 21;
+        List *scattered = malloc(sizeof(List) * length);
+        size_t *order = malloc(sizeof(size_t) * length);
+        assert(NULL != scattered && NULL != order);
+
+        // link the nodes in a shuffled order.
+        uint32_t random = 2463534242u;
+        for (size_t index = 0; index < length; index++) {
+            order[index] = index;
+        }
+        for (size_t index = length - 1; index > 0; index--) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            size_t other = random % (index + 1);
+            size_t temp = order[index];
+            order[index] = order[other];
+            order[other] = temp;
+        }
+        for (size_t index = 0; index < length; index++) {
+            List *next = index + 1 < length ? &scattered[order[index + 1]] : NULL;
+            scattered[order[index]] = list_create(next, (int)index);
+        }
+        List *root = &scattered[order[0]];
+
+        double start = seconds_now();
+        ListIter list_iter = list_iter_create(root);
+        long long plain_sum = 0;
+        List *node = NULL;
+        while (list_iter.iter.next(&list_iter.iter, &node)) {
+            plain_sum += node->data;
+        }
+        printf("list_iter_next: %.3f seconds\n", seconds_now() - start);
+
+        for (uint32_t distance = 2; distance <= PREFETCH_MAX_DISTANCE; distance *= 2) {
+            list_set_jumps(root, distance);
+
+            start = seconds_now();
+            prefetch_iter = prefetch_list_iter_create(root);
+            long long prefetch_sum = 0;
+            while (prefetch_iter.iter.next(&prefetch_iter.iter, &node)) {
+                prefetch_sum += node->data;
+            }
+            double elapsed = seconds_now() - start;
+            assert(plain_sum == prefetch_sum);
+            printf("prefetch distance %u: %.3f seconds\n", distance, elapsed);
+        }
+
+        // after compacting, the walk is a sequential scan.
+        HeapAllocator heap_allocator = heap_allocator_create();
+        list_set_jumps(root, 0);
+        List *compacted = list_compact(root, &heap_allocator.allocator);
+        assert(NULL != compacted);
+
+        start = seconds_now();
+        list_iter = list_iter_create(compacted);
+        long long compacted_sum = 0;
+        while (list_iter.iter.next(&list_iter.iter, &node)) {
+            compacted_sum += node->data;
+        }
+        double elapsed = seconds_now() - start;
+        assert(plain_sum == compacted_sum);
+        printf("compacted list_iter_next: %.3f seconds\n", elapsed);
+
+        heap_allocator.allocator.free(&heap_allocator.allocator, compacted);
+        free(scattered);
+        free(order);
+
+        printf("prefetching lists test passed\n");
+    }
+
+    printf("\nlist compaction:\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+
+        // a list linked backwards through an array.
+        List nodes[50];
+        for (int index = 0; index < 50; index++) {
+            nodes[index] = list_create(index > 0 ? &nodes[index - 1] : NULL, index);
+        }
+        list_set_jumps(&nodes[49], 4);
+
+        List *compacted = list_compact(&nodes[49], &heap_allocator.allocator);
+        assert(NULL != compacted);
+
+        // the nodes are now in traversal order, one after another.
+        for (int index = 0; index < 50; index++) {
+            assert(49 - index == compacted[index].data);
+            assert((index < 49 ? &compacted[index + 1] : NULL) == compacted[index].next);
+        }
+
+        // jump pointers keep their distance.
+        assert(&compacted[4] == compacted[0].jump);
+        assert(NULL == compacted[46].jump);
+
+        // the original list is untouched.
+        assert(&nodes[48] == nodes[49].next);
+
+        heap_allocator.allocator.free(&heap_allocator.allocator, compacted);
+
+        assert(NULL == list_compact(NULL, &heap_allocator.allocator));
+
+        printf("list compaction test passed\n");
+    }
+
+    printf("\npool lists:\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        ListPool pool = list_pool_create(&heap_allocator.allocator, 2);
+
+        // build a list the same way as with list_create, growing the pool.
+        uint32_t third = list_pool_node(&pool, LIST_POOL_NONE, 3);
+        uint32_t second = list_pool_node(&pool, third, 2);
+        uint32_t root = list_pool_node(&pool, second, 1);
+        assert(LIST_POOL_NONE != root);
+        assert(3 == pool.count && pool.capacity >= 3);
+
+        PoolListIter pool_iter = pool_list_iter_create(&pool, root);
+        PoolNode *node = NULL;
+        int expected = 1;
+        while (pool_iter.iter.next(&pool_iter.iter, &node)) {
+            assert(expected == node->data);
+            expected++;
+        }
+        assert(4 == expected);
+
+        // a released node is reused.
+        list_pool_get(&pool, root)->next = third;
+        list_pool_release(&pool, second);
+        assert(second == list_pool_node(&pool, LIST_POOL_NONE, 10));
+        assert(3 == pool.count);
+
+        // a longer list, walked in batches.
+        uint32_t head = LIST_POOL_NONE;
+        for (int value = 99; value >= 0; value--) {
+            head = list_pool_node(&pool, head, value);
+            assert(LIST_POOL_NONE != head);
+        }
+
+        PoolNode *batch[64];
+        pool_iter = pool_list_iter_create(&pool, head);
+        assert(64 == iter_next_batch(&pool_iter.iter, batch, sizeof(batch[0]), 64));
+        assert(36 == iter_next_batch(&pool_iter.iter, batch, sizeof(batch[0]), 64));
+        assert(99 == batch[35]->data);
+
+        // the pool can be moved with a memcpy, and the lists still work.
+        PoolNode *moved = malloc(sizeof(PoolNode) * pool.count);
+        assert(NULL != moved);
+        memcpy(moved, pool.nodes, sizeof(PoolNode) * pool.count);
+        ListPool moved_pool = pool;
+        moved_pool.nodes = moved;
+
+        pool_iter = pool_list_iter_create(&moved_pool, head);
+        expected = 0;
+        while (pool_iter.iter.next(&pool_iter.iter, &node)) {
+            assert(expected == node->data);
+            expected++;
+        }
+        assert(100 == expected);
+        free(moved);
+
+        list_pool_destroy(&pool);
+
+        printf("pool lists test passed\n");
+    }
+
+    printf("\ntables:\n");
+    {
+        HeapAllocator heap_allocator = heap_allocator_create();
+        Table table = table_create(&heap_allocator.allocator, particle_sizes, PARTICLE_COLUMNS);
+
+        // records go in by scattering their fields into the columns.
+        for (uint32_t index = 0; index < 1000; index++) {
+            Particle particle = { index, (float)index, 0, 0, 1.0f, 0, 0, 2.0f, "particle" };
+            assert(table_push(&table, &particle, particle_offsets));
+        }
+        assert(1000 == table.count);
+
+        // and come back out by gathering them.
+        Particle particle;
+        table_gather(&table, 500, &particle, particle_offsets);
+        assert(500 == particle.id && 500.0f == particle.x && 2.0f == particle.mass);
+        assert(0 == strcmp("particle", particle.name));
+
+        // reading two columns a slice at a time.
+        size_t columns[] = { PARTICLE_X, PARTICLE_VX };
+        ColumnIter column_iter = column_iter_create(&table, columns, 2, 256);
+        size_t lower = 0;
+        size_t upper = 0;
+        iter_size_hint(&column_iter.iter, &lower, &upper);
+        assert(4 == lower && 4 == upper);
+
+        ColumnSlice slice;
+        double sum = 0;
+        size_t rows = 0;
+        while (column_iter.iter.next(&column_iter.iter, &slice)) {
+            assert(rows == slice.row);
+            const float *x = slice.columns[0];
+            const float *vx = slice.columns[1];
+            for (size_t index = 0; index < slice.count; index++) {
+                sum += x[index] + vx[index];
+            }
+            rows += slice.count;
+        }
+        assert(1000 == rows);
+        assert(999.0 * 1000 / 2 + 1000 == sum);
+
+        // gathering and scattering some rows of a column.
+        size_t picked[] = { 3, 700, 42 };
+        float values[3];
+        table_gather_column(&table, PARTICLE_X, picked, 3, values);
+        assert(3.0f == values[0] && 700.0f == values[1] && 42.0f == values[2]);
+
+        float zeros[3] = { 0 };
+        table_scatter_column(&table, PARTICLE_X, picked, 3, zeros);
+        assert(0.0f == ((float*)table_column(&table, PARTICLE_X))[700]);
+
+        table_destroy(&table);
+
+        // compare summing two fields of a million records stored both ways.
+        const size_t length = 1 << 20;
+        Particle *records = malloc(sizeof(Particle) * length);
+        assert(NULL != records);
+        table = table_create(&heap_allocator.allocator, particle_sizes, PARTICLE_COLUMNS);
+        assert(table_reserve(&table, length));
+        for (size_t index = 0; index < length; index++) {
+            records[index] = (Particle){ (uint32_t)index, (float)(index % 100), 0, 0, 0.5f, 0, 0, 1.0f, "" };
+            assert(table_push(&table, &records[index], particle_offsets));
+        }
+
+        double start = seconds_now();
+        float records_sum = 0;
+        for (size_t index = 0; index < length; index++) {
+            records_sum += records[index].x + records[index].vx;
+        }
+        printf("array of structs: %.3f seconds\n", seconds_now() - start);
+
+        start = seconds_now();
+        column_iter = column_iter_create(&table, columns, 2, 1024);
+        float table_sum = 0;
+        while (column_iter.iter.next(&column_iter.iter, &slice)) {
+            const float *x = slice.columns[0];
+            const float *vx = slice.columns[1];
+            for (size_t index = 0; index < slice.count; index++) {
+                table_sum += x[index] + vx[index];
+            }
+        }
+        printf("struct of arrays: %.3f seconds\n", seconds_now() - start);
+        assert(records_sum == table_sum);
+
+        table_destroy(&table);
+        free(records);
+
+        printf("tables test passed\n");
+    }
+}
+
+// Get up to max results from an iterator, using its batch function if it has one,
+// and calling next for each result if not. The element size is only needed for
+// the fallback, to find where each result goes.
+size_t iter_next_batch(Iter *iter, void *results, size_t element_size, size_t max) {
+    if (NULL != iter->next_batch) {
+        return iter->next_batch(iter, results, max);
+    }
+
+    uint8_t *result = (uint8_t*)results;
+    size_t count = 0;
+    while ((count < max) && iter->next(iter, result)) {
+        result += element_size;
+        count++;
+    }
+
+    return count;
+}
+
+// Get the bounds on an iterator's remaining length, using its size hint function
+// if it has one, and knowing nothing if not.
+void iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    if (NULL != iter->size_hint) {
+        iter->size_hint(iter, lower, upper);
+        return;
+    }
+
+    *lower = 0;
+    *upper = SIZE_MAX;
+}
+
+// Copy an adapter into memory from an allocator, so it can outlive the scope
+// that created it. Adapters only point to the iterators they wrap, never into
+// themselves (a FlatMapIter keeps an offset into its storage instead), so an
+// adapter can be copied even after it has started.
+void *iter_box(Allocator *allocator, const void *adapter, size_t size) {
+    void *boxed = allocator->alloc(allocator, size);
+    if (NULL != boxed) {
+        memcpy(boxed, adapter, size);
+    }
+
+    return boxed;
+}
+
+// Create a new range given the initial and ending value.
+Range range_create(uint32_t start, uint32_t end) {
+    // the maximum uint32_t would cause an overflow of the iterator index.
+    assert(0xFFFFFFFF != end);
+
+    return (Range){ { range_next, range_next_batch, range_size_hint }, start, end };
+}
+
+// Range type iterator implementation.
+bool range_next(Iter *iter, void *value) {
+    Range *range = (Range*)container_of(iter, Range, iter);
+
+    uint32_t *result = (uint32_t*)value;
+
+    // update the iterator result with the current range value.
+    *result = range->current;
+
+    // step to the next value.
+    range->current++;
+
+    // we are done only if we move past the range end.
+    return range->current <= range->end;
+}
+
+// Range type batch implementation. The values are just the next block of
+// numbers, written with a simple loop the compiler can vectorize.
+size_t range_next_batch(Iter *iter, void *values, size_t max) {
+    Range *range = (Range*)container_of(iter, Range, iter);
+
+    uint32_t *results = (uint32_t*)values;
+
+    // the range may already be done, and next leaves current past the end.
+    if (range->current >= range->end) {
+        return 0;
+    }
+
+    size_t count = range->end - range->current;
+    if (count > max) {
+        count = max;
+    }
+
+    uint32_t current = range->current;
+    for (size_t index = 0; index < count; index++) {
+        results[index] = current + (uint32_t)index;
+    }
+    range->current = current + (uint32_t)count;
+
+    return count;
+}
+
+// A range knows exactly how many values it has left.
+void range_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    Range *range = (Range*)container_of(iter, Range, iter);
+
+    size_t remaining = 0;
+    if (range->current < range->end) {
+        remaining = range->end - range->current;
+    }
+
+    *lower = remaining;
+    *upper = remaining;
+}
+
+// Create a new list node given its next node in the
+// sequence, and the data that the node will contain.
+List list_create(List *next, int data) {
+    return (List){ next, NULL, data };
+}
+
+// Copy a list into a single new block from the allocator, with the nodes in the
+// order the list is walked, returning the new first node. Walking the copy is a
+// sequential scan of memory, however scattered the original nodes were. Jump
+// pointers are kept at the same distance.
+// The original nodes are left as they are, for the caller to free however they
+// were allocated, and the copy is freed by freeing the returned node. NULL is
+// returned for an empty list, or if the block couldn't be allocated.
+List *list_compact(List *root, Allocator *allocator) {
+    size_t count = 0;
+    for (List *node = root; NULL != node; node = node->next) {
+        count++;
+    }
+
+    if (0 == count) {
+        return NULL;
+    }
+
+    List *nodes = allocator->alloc(allocator, sizeof(List) * count);
+    if (NULL == nodes) {
+        return NULL;
+    }
+
+    // find the jump distance from the first node, if it has a jump pointer.
+    size_t jump_distance = 0;
+    if (NULL != root->jump) {
+        List *node = root;
+        while (NULL != node && node != root->jump && jump_distance <= PREFETCH_MAX_DISTANCE) {
+            node = node->next;
+            jump_distance++;
+        }
+        if (node != root->jump) {
+            jump_distance = 0;
+        }
+    }
+
+    size_t index = 0;
+    for (List *node = root; NULL != node; node = node->next, index++) {
+        List *next = index + 1 < count ? &nodes[index + 1] : NULL;
+        List *jump = NULL;
+        if (jump_distance > 0 && index + jump_distance < count) {
+            jump = &nodes[index + jump_distance];
+        }
+
+        nodes[index] = (List){ next, jump, node->data };
+    }
+
+    return nodes;
+}
+
+ListIter list_iter_create(List *root) {
+    return (ListIter){ { list_iter_next, list_iter_next_batch, NULL }, root };
+}
+
+// List type iterator implementation.
+bool list_iter_next(Iter *iter, void *value) {
+    ListIter *list_iter = (ListIter*)container_of(iter, ListIter, iter);
+
+    List **result = (List**)value;
+
+    // the result is the current list node
+    *result = list_iter->current;
+
+    // there are more nodes if the current node has a non-null link.
+    bool more_nodes = list_iter->current != NULL;
+    if (more_nodes) {
+        // move our current location in the list to the next node.
+        list_iter->current = list_iter->current->next;
+    }
+
+    // if the current node is NULL, we reached the end of the list,
+    // so stop the iteration.
+    return more_nodes;
+}
+
+// List type batch implementation, walking up to max nodes in one call.
+size_t list_iter_next_batch(Iter *iter, void *values, size_t max) {
+    ListIter *list_iter = (ListIter*)container_of(iter, ListIter, iter);
+
+    List **results = (List**)values;
+
+    List *current = list_iter->current;
+    size_t count = 0;
+    while ((count < max) && (NULL != current)) {
+        results[count] = current;
+        current = current->next;
+        count++;
+    }
+    list_iter->current = current;
+
+    return count;
+}
+
+/* List Pool */
+// Create a pool with room for the given number of nodes, which it grows past as
+// needed. If the allocation fails the pool starts out empty.
+ListPool list_pool_create(Allocator *allocator, uint32_t capacity) {
+    PoolNode *nodes = NULL;
+    if (capacity > 0) {
+        capacity = allocator->good_size(allocator, sizeof(PoolNode) * capacity) / sizeof(PoolNode);
+        nodes = allocator->alloc(allocator, sizeof(PoolNode) * capacity);
+    }
+
+    return (ListPool){ allocator, nodes, 0, NULL != nodes ? capacity : 0, LIST_POOL_NONE };
+}
+
+void list_pool_destroy(ListPool *pool) {
+    if (NULL != pool->nodes) {
+        pool->allocator->free(pool->allocator, pool->nodes);
+        pool->nodes = NULL;
+    }
+    pool->count = 0;
+    pool->capacity = 0;
+    pool->free_head = LIST_POOL_NONE;
+}
+
+// Add a node to the pool, linking to the node at the index next, and returning
+// the new node's index. This is the pool version of list_create. Returns
+// LIST_POOL_NONE if the pool is full and couldn't grow.
+uint32_t list_pool_node(ListPool *pool, uint32_t next, int data) {
+    uint32_t index = pool->free_head;
+    if (LIST_POOL_NONE != index) {
+        pool->free_head = pool->nodes[index].next;
+    } else {
+        if (pool->count == pool->capacity) {
+            // double the array, stopping short of the index that marks the end.
+            uint64_t new_capacity = pool->capacity == 0 ? 16 : (uint64_t)pool->capacity * 2;
+            if (new_capacity > LIST_POOL_NONE) {
+                new_capacity = LIST_POOL_NONE;
+            }
+            if (new_capacity == pool->capacity) {
+                return LIST_POOL_NONE;
+            }
+
+            // the nodes are copied over ourselves rather then using realloc, as
+            // allocators like the bump allocator can't copy them for us.
+            Allocator *allocator = pool->allocator;
+            PoolNode *nodes = allocator->alloc(allocator, sizeof(PoolNode) * new_capacity);
+            if (NULL == nodes) {
+                return LIST_POOL_NONE;
+            }
+            if (NULL != pool->nodes) {
+                memcpy(nodes, pool->nodes, sizeof(PoolNode) * pool->count);
+                allocator->free(allocator, pool->nodes);
+            }
+
+            pool->nodes = nodes;
+            pool->capacity = (uint32_t)new_capacity;
+        }
+
+        index = pool->count;
+        pool->count++;
+    }
+
+    pool->nodes[index] = (PoolNode){ next, data };
+
+    return index;
+}
+
+// Give a node back to the pool to be reused. It must no longer be linked from
+// any list.
+void list_pool_release(ListPool *pool, uint32_t index) {
+    assert(index < pool->count);
+
+    pool->nodes[index].next = pool->free_head;
+    pool->free_head = index;
+}
+
+PoolNode *list_pool_get(const ListPool *pool, uint32_t index) {
+    assert(index < pool->count);
+
+    return &pool->nodes[index];
+}
+
+PoolListIter pool_list_iter_create(const ListPool *pool, uint32_t root) {
+    return (PoolListIter){ { pool_list_iter_next, pool_list_iter_next_batch, NULL }, pool, root };
+}
+
+bool pool_list_iter_next(Iter *iter, void *value) {
+    PoolListIter *pool_iter = (PoolListIter*)container_of(iter, PoolListIter, iter);
+
+    if (LIST_POOL_NONE == pool_iter->current) {
+        return false;
+    }
+
+    PoolNode *node = list_pool_get(pool_iter->pool, pool_iter->current);
+    *(PoolNode**)value = node;
+    pool_iter->current = node->next;
+
+    return true;
+}
+
+size_t pool_list_iter_next_batch(Iter *iter, void *values, size_t max) {
+    PoolListIter *pool_iter = (PoolListIter*)container_of(iter, PoolListIter, iter);
+
+    PoolNode **results = (PoolNode**)values;
+    PoolNode *nodes = pool_iter->pool->nodes;
+    uint32_t current = pool_iter->current;
+    size_t count = 0;
+    while ((count < max) && (LIST_POOL_NONE != current)) {
+        results[count] = &nodes[current];
+        current = nodes[current].next;
+        count++;
+    }
+    pool_iter->current = current;
+
+    return count;
+}
+
+/* Prefetching List Iterator */
+// Point each node's jump pointer at the node distance nodes after it, or NULL if
+// there isn't one. A distance of 0 clears the jump pointers. The distance should
+// cover the time to load a node from memory, in nodes walked- too short and the
+// node isn't ready yet, too long and it may be evicted again before it is used.
+void list_set_jumps(List *root, uint32_t distance) {
+    if (distance > PREFETCH_MAX_DISTANCE) {
+        distance = PREFETCH_MAX_DISTANCE;
+    }
+
+    // the last distance nodes, waiting for the node distance after them.
+    List *ring[PREFETCH_MAX_DISTANCE];
+    size_t index = 0;
+
+    for (List *node = root; NULL != node; node = node->next, index++) {
+        node->jump = NULL;
+        if (0 == distance) {
+            continue;
+        }
+
+        if (index >= distance) {
+            ring[index % distance]->jump = node;
+        }
+        ring[index % distance] = node;
+    }
+}
+
+PrefetchListIter prefetch_list_iter_create(List *root) {
+    return (PrefetchListIter){ { prefetch_list_iter_next, prefetch_list_iter_next_batch, NULL }, root };
+}
+
+bool prefetch_list_iter_next(Iter *iter, void *value) {
+    PrefetchListIter *prefetch_iter = (PrefetchListIter*)container_of(iter, PrefetchListIter, iter);
+
+    List *current = prefetch_iter->current;
+    if (NULL == current) {
+        return false;
+    }
+
+    if (NULL != current->jump) {
+        __builtin_prefetch(current->jump);
+    }
+
+    *(List**)value = current;
+    prefetch_iter->current = current->next;
+
+    return true;
+}
+
+size_t prefetch_list_iter_next_batch(Iter *iter, void *values, size_t max) {
+    PrefetchListIter *prefetch_iter = (PrefetchListIter*)container_of(iter, PrefetchListIter, iter);
+
+    List **results = (List**)values;
+    List *current = prefetch_iter->current;
+    size_t count = 0;
+    while ((count < max) && (NULL != current)) {
+        if (NULL != current->jump) {
+            __builtin_prefetch(current->jump);
+        }
+        results[count] = current;
+        current = current->next;
+        count++;
+    }
+    prefetch_iter->current = current;
+
+    return count;
+}
+
+/* Unrolled List */
+UnrolledList unrolled_list_create(Allocator *allocator) {
+    return (UnrolledList){ allocator, NULL, NULL, 0 };
+}
+
+void unrolled_list_destroy(UnrolledList *list) {
+    UnrolledNode *node = list->head;
+    while (NULL != node) {
+        UnrolledNode *next = node->next;
+        list->allocator->free(list->allocator, node);
+        node = next;
+    }
+
+    list->head = NULL;
+    list->tail = NULL;
+    list->count = 0;
+}
+
+// Allocate an empty node to go after the given node, or at the front of the
+// list if that is NULL.
+static UnrolledNode *unrolled_list_add_node(UnrolledList *list, UnrolledNode *previous) {
+    UnrolledNode *node = list->allocator->alloc(list->allocator, sizeof(UnrolledNode));
+    if (NULL == node) {
+        return NULL;
+    }
+
+    node->count = 0;
+    if (NULL == previous) {
+        node->next = list->head;
+        list->head = node;
+    } else {
+        node->next = previous->next;
+        previous->next = node;
+    }
+
+    if (NULL == node->next) {
+        list->tail = node;
+    }
+
+    return node;
+}
+
+// Add an element to the end of the list, returning false if a node couldn't be
+// allocated.
+bool unrolled_list_push(UnrolledList *list, int data) {
+    UnrolledNode *tail = list->tail;
+    if (NULL == tail || UNROLLED_NODE_LENGTH == tail->count) {
+        tail = unrolled_list_add_node(list, tail);
+        if (NULL == tail) {
+            return false;
+        }
+    }
+
+    tail->data[tail->count] = data;
+    tail->count++;
+    list->count++;
+
+    return true;
+}
+
+// Move the back half of a node's elements to a new node after it, returning the
+// new node, or NULL if it couldn't be allocated.
+UnrolledNode *unrolled_list_split(UnrolledList *list, UnrolledNode *node) {
+    UnrolledNode *next = unrolled_list_add_node(list, node);
+    if (NULL == next) {
+        return NULL;
+    }
+
+    uint32_t keep = node->count / 2;
+    next->count = node->count - keep;
+    memcpy(next->data, &node->data[keep], sizeof(int) * next->count);
+    node->count = keep;
+
+    return next;
+}
+
+// Insert an element so that it ends up at the given index, returning false if a
+// node couldn't be allocated. A full node is split in half first, which leaves
+// room in both halves for later inserts.
+bool unrolled_list_insert(UnrolledList *list, size_t index, int data) {
+    assert(index <= list->count);
+
+    if (index == list->count) {
+        return unrolled_list_push(list, data);
+    }
+
+    // find the node holding the element currently at index.
+    UnrolledNode *node = list->head;
+    while (index >= node->count) {
+        index -= node->count;
+        node = node->next;
+    }
+
+    if (UNROLLED_NODE_LENGTH == node->count) {
+        UnrolledNode *next = unrolled_list_split(list, node);
+        if (NULL == next) {
+            return false;
+        }
+
+        if (index > node->count) {
+            index -= node->count;
+            node = next;
+        }
+    }
+
+    memmove(&node->data[index + 1], &node->data[index], sizeof(int) * (node->count - index));
+    node->data[index] = data;
+    node->count++;
+    list->count++;
+
+    return true;
+}
+
+UnrolledIter unrolled_iter_create(const UnrolledList *list) {
+    return (UnrolledIter){
+        { unrolled_iter_next, unrolled_iter_next_batch, unrolled_iter_size_hint },
+        list->head,
+        0,
+        list->count,
+    };
+}
+
+bool unrolled_iter_next(Iter *iter, void *value) {
+    UnrolledIter *unrolled_iter = (UnrolledIter*)container_of(iter, UnrolledIter, iter);
+
+    // move past the end of the current node, skipping any empty nodes.
+    while (NULL != unrolled_iter->current && unrolled_iter->index >= unrolled_iter->current->count) {
+        unrolled_iter->current = unrolled_iter->current->next;
+        unrolled_iter->index = 0;
+    }
+
+    if (NULL == unrolled_iter->current) {
+        return false;
+    }
+
+    *(int*)value = unrolled_iter->current->data[unrolled_iter->index];
+    unrolled_iter->index++;
+    unrolled_iter->remaining--;
+
+    return true;
+}
+
+// Copy elements a node at a time, only chasing a pointer per node.
+size_t unrolled_iter_next_batch(Iter *iter, void *values, size_t max) {
+    UnrolledIter *unrolled_iter = (UnrolledIter*)container_of(iter, UnrolledIter, iter);
+
+    int *results = (int*)values;
+    size_t count = 0;
+    while (count < max && NULL != unrolled_iter->current) {
+        UnrolledNode *node = unrolled_iter->current;
+
+        size_t available = node->count - unrolled_iter->index;
+        if (available > max - count) {
+            available = max - count;
+        }
+
+        memcpy(&results[count], &node->data[unrolled_iter->index], sizeof(int) * available);
+        count += available;
+        unrolled_iter->index += available;
+
+        if (unrolled_iter->index >= node->count) {
+            unrolled_iter->current = node->next;
+            unrolled_iter->index = 0;
+        }
+    }
+    unrolled_iter->remaining -= count;
+
+    return count;
+}
+
+// The list keeps a count, so the length is exact.
+void unrolled_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    UnrolledIter *unrolled_iter = (UnrolledIter*)container_of(iter, UnrolledIter, iter);
+
+    *lower = unrolled_iter->remaining;
+    *upper = unrolled_iter->remaining;
+}
+
+/* Map */
+MapIter map_iter_create(Iter *inner, size_t input_size, size_t output_size, IterMapFn fn, void *context) {
+    assert(input_size <= ITER_SCRATCH_SIZE);
+
+    return (MapIter){
+        { map_iter_next, map_iter_next_batch, map_iter_size_hint },
+        inner,
+        input_size,
+        output_size,
+        fn,
+        context,
+        { 0 },
+    };
+}
+
+bool map_iter_next(Iter *iter, void *value) {
+    MapIter *map_iter = (MapIter*)container_of(iter, MapIter, iter);
+
+    if (!map_iter->inner->next(map_iter->inner, map_iter->scratch)) {
+        return false;
+    }
+
+    map_iter->fn(map_iter->context, map_iter->scratch, value, 1);
+    return true;
+}
+
+// Read as many inputs as fit in the scratch buffer, and map them all at once,
+// repeating until the results are full. A short batch means the iterator is
+// done, so the results can't be cut short by the size of the scratch buffer.
+size_t map_iter_next_batch(Iter *iter, void *values, size_t max) {
+    MapIter *map_iter = (MapIter*)container_of(iter, MapIter, iter);
+
+    uint8_t *results = (uint8_t*)values;
+    size_t capacity = ITER_SCRATCH_SIZE / map_iter->input_size;
+
+    size_t total = 0;
+    while (total < max) {
+        size_t wanted = max - total;
+        if (wanted > capacity) {
+            wanted = capacity;
+        }
+
+        size_t count = iter_next_batch(map_iter->inner, map_iter->scratch, map_iter->input_size, wanted);
+        map_iter->fn(map_iter->context, map_iter->scratch, &results[total * map_iter->output_size], count);
+        total += count;
+
+        if (count < wanted) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+// Mapping keeps the length of the inner iterator.
+void map_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    MapIter *map_iter = (MapIter*)container_of(iter, MapIter, iter);
+
+    iter_size_hint(map_iter->inner, lower, upper);
+}
+
+/* Filter */
+FilterIter filter_iter_create(Iter *inner, size_t element_size, IterFilterFn fn, void *context) {
+    return (FilterIter){ { filter_iter_next, filter_iter_next_batch, filter_iter_size_hint }, inner, element_size, fn, context };
+}
+
+bool filter_iter_next(Iter *iter, void *value) {
+    FilterIter *filter_iter = (FilterIter*)container_of(iter, FilterIter, iter);
+
+    while (filter_iter->inner->next(filter_iter->inner, value)) {
+        if (filter_iter->fn(filter_iter->context, value)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Read a batch straight into the results, and pack the elements we keep to the
+// front. A short batch means the iterator is done, so keep reading into the
+// rest of the results until they are full or the inner iterator runs out.
+size_t filter_iter_next_batch(Iter *iter, void *values, size_t max) {
+    FilterIter *filter_iter = (FilterIter*)container_of(iter, FilterIter, iter);
+
+    uint8_t *results = (uint8_t*)values;
+    size_t element_size = filter_iter->element_size;
+
+    size_t kept = 0;
+    while (kept < max) {
+        uint8_t *batch = &results[kept * element_size];
+        size_t wanted = max - kept;
+        size_t count = iter_next_batch(filter_iter->inner, batch, element_size, wanted);
+
+        for (size_t index = 0; index < count; index++) {
+            uint8_t *element = &batch[index * element_size];
+            if (filter_iter->fn(filter_iter->context, element)) {
+                if (&results[kept * element_size] != element) {
+                    memcpy(&results[kept * element_size], element, element_size);
+                }
+                kept++;
+            }
+        }
+
+        if (count < wanted) {
+            break;
+        }
+    }
+
+    return kept;
+}
+
+// Any number of the inner iterator's elements may be dropped.
+void filter_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    FilterIter *filter_iter = (FilterIter*)container_of(iter, FilterIter, iter);
+
+    size_t inner_lower = 0;
+    iter_size_hint(filter_iter->inner, &inner_lower, upper);
+    *lower = 0;
+}
+
+/* Take */
+TakeIter take_iter_create(Iter *inner, size_t element_size, size_t count) {
+    return (TakeIter){ { take_iter_next, take_iter_next_batch, take_iter_size_hint }, inner, element_size, count };
+}
+
+bool take_iter_next(Iter *iter, void *value) {
+    TakeIter *take_iter = (TakeIter*)container_of(iter, TakeIter, iter);
+
+    if ((0 == take_iter->remaining) || !take_iter->inner->next(take_iter->inner, value)) {
+        return false;
+    }
+
+    take_iter->remaining--;
+    return true;
+}
+
+size_t take_iter_next_batch(Iter *iter, void *values, size_t max) {
+    TakeIter *take_iter = (TakeIter*)container_of(iter, TakeIter, iter);
+
+    if (max > take_iter->remaining) {
+        max = take_iter->remaining;
+    }
+
+    size_t count = iter_next_batch(take_iter->inner, values, take_iter->element_size, max);
+    take_iter->remaining -= count;
+
+    return count;
+}
+
+void take_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    TakeIter *take_iter = (TakeIter*)container_of(iter, TakeIter, iter);
+
+    iter_size_hint(take_iter->inner, lower, upper);
+    if (*lower > take_iter->remaining) {
+        *lower = take_iter->remaining;
+    }
+    if (*upper > take_iter->remaining) {
+        *upper = take_iter->remaining;
+    }
+}
+
+/* Skip */
+SkipIter skip_iter_create(Iter *inner, size_t element_size, size_t count) {
+    return (SkipIter){ { skip_iter_next, skip_iter_next_batch, skip_iter_size_hint }, inner, element_size, count };
+}
+
+bool skip_iter_next(Iter *iter, void *value) {
+    SkipIter *skip_iter = (SkipIter*)container_of(iter, SkipIter, iter);
+
+    // the skipped elements are read into the result, and then overwritten.
+    for (; skip_iter->skip > 0; skip_iter->skip--) {
+        if (!skip_iter->inner->next(skip_iter->inner, value)) {
+            return false;
+        }
+    }
+
+    return skip_iter->inner->next(skip_iter->inner, value);
+}
+
+size_t skip_iter_next_batch(Iter *iter, void *values, size_t max) {
+    SkipIter *skip_iter = (SkipIter*)container_of(iter, SkipIter, iter);
+
+    // with no room for results, the skipping can't make progress.
+    if (0 == max) {
+        return 0;
+    }
+
+    while (skip_iter->skip > 0) {
+        size_t batch = skip_iter->skip < max ? skip_iter->skip : max;
+        size_t count = iter_next_batch(skip_iter->inner, values, skip_iter->element_size, batch);
+        skip_iter->skip -= count;
+        if (count < batch) {
+            return 0;
+        }
+    }
+
+    return iter_next_batch(skip_iter->inner, values, skip_iter->element_size, max);
+}
+
+void skip_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    SkipIter *skip_iter = (SkipIter*)container_of(iter, SkipIter, iter);
+
+    iter_size_hint(skip_iter->inner, lower, upper);
+    *lower = *lower > skip_iter->skip ? *lower - skip_iter->skip : 0;
+    // no known bound stays unknown.
+    if (SIZE_MAX != *upper) {
+        *upper = *upper > skip_iter->skip ? *upper - skip_iter->skip : 0;
+    }
+}
+
+/* Zip */
+ZipIter zip_iter_create(Iter *first, Iter *second, size_t second_offset) {
+    return (ZipIter){ { zip_iter_next, NULL, zip_iter_size_hint }, first, second, second_offset };
+}
+
+bool zip_iter_next(Iter *iter, void *value) {
+    ZipIter *zip_iter = (ZipIter*)container_of(iter, ZipIter, iter);
+
+    uint8_t *result = (uint8_t*)value;
+    return zip_iter->first->next(zip_iter->first, result) &&
+           zip_iter->second->next(zip_iter->second, result + zip_iter->second_offset);
+}
+
+// A zip stops with the shorter of its iterators.
+void zip_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    ZipIter *zip_iter = (ZipIter*)container_of(iter, ZipIter, iter);
+
+    size_t second_lower = 0;
+    size_t second_upper = 0;
+    iter_size_hint(zip_iter->first, lower, upper);
+    iter_size_hint(zip_iter->second, &second_lower, &second_upper);
+
+    if (*lower > second_lower) {
+        *lower = second_lower;
+    }
+    if (*upper > second_upper) {
+        *upper = second_upper;
+    }
+}
+
+/* Chain */
+ChainIter chain_iter_create(Iter *first, Iter *second, size_t element_size) {
+    return (ChainIter){ { chain_iter_next, chain_iter_next_batch, chain_iter_size_hint }, first, second, element_size, false };
+}
+
+bool chain_iter_next(Iter *iter, void *value) {
+    ChainIter *chain_iter = (ChainIter*)container_of(iter, ChainIter, iter);
+
+    if (!chain_iter->first_done) {
+        if (chain_iter->first->next(chain_iter->first, value)) {
+            return true;
+        }
+        chain_iter->first_done = true;
+    }
+
+    return chain_iter->second->next(chain_iter->second, value);
+}
+
+size_t chain_iter_next_batch(Iter *iter, void *values, size_t max) {
+    ChainIter *chain_iter = (ChainIter*)container_of(iter, ChainIter, iter);
+
+    size_t count = 0;
+    if (!chain_iter->first_done) {
+        count = iter_next_batch(chain_iter->first, values, chain_iter->element_size, max);
+        if (count == max) {
+            return count;
+        }
+        chain_iter->first_done = true;
+    }
+
+    // fill the rest of the batch from the second iterator.
+    uint8_t *rest = (uint8_t*)values + count * chain_iter->element_size;
+    return count + iter_next_batch(chain_iter->second, rest, chain_iter->element_size, max - count);
+}
+
+// A chain has the elements of both its iterators, although once the first is
+// done it is not asked again.
+void chain_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    ChainIter *chain_iter = (ChainIter*)container_of(iter, ChainIter, iter);
+
+    size_t first_lower = 0;
+    size_t first_upper = 0;
+    if (!chain_iter->first_done) {
+        iter_size_hint(chain_iter->first, &first_lower, &first_upper);
+    }
+    iter_size_hint(chain_iter->second, lower, upper);
+
+    // add the bounds, saturating rather than overflowing.
+    *lower = *lower > SIZE_MAX - first_lower ? SIZE_MAX : *lower + first_lower;
+    *upper = *upper > SIZE_MAX - first_upper ? SIZE_MAX : *upper + first_upper;
+}
+
+/* Enumerate */
+EnumerateIter enumerate_iter_create(Iter *inner, size_t value_offset) {
+    assert(value_offset >= sizeof(size_t));
+
+    return (EnumerateIter){ { enumerate_iter_next, NULL, enumerate_iter_size_hint }, inner, value_offset, 0 };
+}
+
+bool enumerate_iter_next(Iter *iter, void *value) {
+    EnumerateIter *enumerate_iter = (EnumerateIter*)container_of(iter, EnumerateIter, iter);
+
+    uint8_t *result = (uint8_t*)value;
+    if (!enumerate_iter->inner->next(enumerate_iter->inner, result + enumerate_iter->value_offset)) {
+        return false;
+    }
+
+    *(size_t*)result = enumerate_iter->index;
+    enumerate_iter->index++;
+    return true;
+}
+
+void enumerate_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    EnumerateIter *enumerate_iter = (EnumerateIter*)container_of(iter, EnumerateIter, iter);
+
+    iter_size_hint(enumerate_iter->inner, lower, upper);
+}
+
+/* Flat Map */
+FlatMapIter flat_map_iter_create(Iter *outer, IterFlatMapFn fn, void *context) {
+    return (FlatMapIter){ { flat_map_iter_next, NULL, NULL }, outer, fn, context, false, 0, { 0 }, { 0 } };
+}
+
+bool flat_map_iter_next(Iter *iter, void *value) {
+    FlatMapIter *flat_map_iter = (FlatMapIter*)container_of(iter, FlatMapIter, iter);
+
+    // move on to the next outer element whenever the current iterator runs out.
+    while (true) {
+        if (flat_map_iter->running) {
+            Iter *current = (Iter*)&flat_map_iter->storage[flat_map_iter->current_offset];
+            if (current->next(current, value)) {
+                return true;
+            }
+        }
+
+        if (!flat_map_iter->outer->next(flat_map_iter->outer, flat_map_iter->item)) {
+            flat_map_iter->running = false;
+            return false;
+        }
+
+        Iter *current = flat_map_iter->fn(flat_map_iter->context, flat_map_iter->item, flat_map_iter->storage);
+        flat_map_iter->current_offset = (uint8_t*)current - flat_map_iter->storage;
+        flat_map_iter->running = true;
+    }
+}
+
+/* Fused */
+// The stages of a fused pipeline may filter out any of the range's values.
+void fused_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    FusedIter *fused = (FusedIter*)container_of(iter, FusedIter, iter);
+
+    *lower = 0;
+    *upper = fused->current < fused->end ? fused->end - fused->current : 0;
+}
+
+/* Vec */
+// Create a Vec with room for the given number of elements, with its memory coming
+// from the given allocator. If the allocation fails the Vec starts out empty.
+Vec vec_create(Allocator *allocator, size_t element_size, size_t capacity) {
+    Vec vec = { allocator, NULL, element_size, 0, 0 };
+    vec_reserve(&vec, capacity);
+
+    return vec;
+}
+
+void vec_destroy(Vec *vec) {
+    if (NULL != vec->data) {
+        vec->allocator->free(vec->allocator, vec->data);
+        vec->data = NULL;
+    }
+    vec->count = 0;
+    vec->capacity = 0;
+}
+
+// Make sure there is room for at least additional more elements, returning false
+// if the memory couldn't be allocated.
+// We copy the elements over ourselves rather then using realloc, as allocators
+// like the bump allocator don't know how large the old array was.
+bool vec_reserve(Vec *vec, size_t additional) {
+    if (additional <= vec->capacity - vec->count) {
+        return true;
+    }
+
+    size_t needed = vec->count + additional;
+    if (needed < vec->count || needed > SIZE_MAX / vec->element_size) {
+        return false;
+    }
+
+    // grow by doubling, so pushing one at a time moves each element a bounded
+    // number of times. Grow into any rounding the allocator does as well.
+    size_t new_capacity = vec->capacity * 2;
+    if (new_capacity < needed) {
+        new_capacity = needed;
+    }
+    if (new_capacity > SIZE_MAX / vec->element_size) {
+        new_capacity = needed;
+    }
+
+    Allocator *allocator = vec->allocator;
+    size_t new_size = allocator->good_size(allocator, new_capacity * vec->element_size);
+    uint8_t *data = allocator->alloc(allocator, new_size);
+    if (NULL == data) {
+        return false;
+    }
+
+    if (NULL != vec->data) {
+        memcpy(data, vec->data, vec->count * vec->element_size);
+        allocator->free(allocator, vec->data);
+    }
+
+    vec->data = data;
+    vec->capacity = new_size / vec->element_size;
+
+    return true;
+}
+
+bool vec_push(Vec *vec, const void *value) {
+    if (!vec_reserve(vec, 1)) {
+        return false;
+    }
+
+    memcpy(&vec->data[vec->count * vec->element_size], value, vec->element_size);
+    vec->count++;
+
+    return true;
+}
+
+void *vec_get(const Vec *vec, size_t index) {
+    assert(index < vec->count);
+
+    return &vec->data[index * vec->element_size];
+}
+
+// Append every element of an iterator, returning false if memory ran out part
+// way through. The iterator's lower size hint is reserved up front, which is
+// the whole length for an exact iterator like Range. Elements are read in
+// batches straight into the spare capacity at the end of the array.
+// The array is only grown once another element is known to be coming, so an
+// iterator that exactly fills the capacity is collected with one allocation.
+bool vec_extend(Vec *vec, Iter *iter) {
+    size_t lower = 0;
+    size_t upper = 0;
+    iter_size_hint(iter, &lower, &upper);
+    if (!vec_reserve(vec, lower)) {
+        return false;
+    }
+
+    // with an exact hint, the iterator is done once that many elements are read.
+    size_t start = vec->count;
+    bool exact = lower == upper;
+
+    while (!exact || (vec->count - start < lower)) {
+        if (vec->count == vec->capacity) {
+            // look for another element before growing. Elements too large to
+            // hold here are read in a batch after making room instead.
+            if (vec->element_size <= ITER_ITEM_SIZE) {
+                _Alignas(max_align_t) uint8_t item[ITER_ITEM_SIZE];
+                if (!iter->next(iter, item)) {
+                    return true;
+                }
+                if (!vec_push(vec, item)) {
+                    return false;
+                }
+                continue;
+            }
+
+            if (!vec_reserve(vec, 1)) {
+                return false;
+            }
+        }
+
+        size_t space = vec->capacity - vec->count;
+        uint8_t *end = &vec->data[vec->count * vec->element_size];
+        size_t count = iter_next_batch(iter, end, vec->element_size, space);
+        vec->count += count;
+
+        // a short batch means the iterator is done.
+        if (count < space) {
+            return true;
+        }
+    }
+
+    return true;
+}
+
+// Collect the elements of an iterator into a new Vec. If memory runs out, the
+// Vec holds the elements collected so far- use vec_extend to find out when that
+// happens.
+Vec vec_collect(Iter *iter, size_t element_size, Allocator *allocator) {
+    Vec vec = vec_create(allocator, element_size, 0);
+    vec_extend(&vec, iter);
+
+    return vec;
+}
+
+/* Vec Iterator */
+VecIter vec_iter_create(const Vec *vec) {
+    return vec_iter_slice(vec, 0, vec->count);
+}
+
+// Iterate over the elements from start up to end only.
+VecIter vec_iter_slice(const Vec *vec, size_t start, size_t end) {
+    assert(start <= end && end <= vec->count);
+
+    return (VecIter){ { vec_iter_next, vec_iter_next_batch, vec_iter_size_hint }, vec, start, end };
+}
+
+bool vec_iter_next(Iter *iter, void *value) {
+    VecIter *vec_iter = (VecIter*)container_of(iter, VecIter, iter);
+
+    if (vec_iter->index >= vec_iter->end) {
+        return false;
+    }
+
+    memcpy(value, vec_get(vec_iter->vec, vec_iter->index), vec_iter->vec->element_size);
+    vec_iter->index++;
+
+    return true;
+}
+
+// The elements are already contiguous, so a batch is a single copy.
+size_t vec_iter_next_batch(Iter *iter, void *values, size_t max) {
+    VecIter *vec_iter = (VecIter*)container_of(iter, VecIter, iter);
+    const Vec *vec = vec_iter->vec;
+
+    size_t count = vec_iter->end - vec_iter->index;
+    if (count > max) {
+        count = max;
+    }
+
+    if (count > 0) {
+        memcpy(values, &vec->data[vec_iter->index * vec->element_size], count * vec->element_size);
+        vec_iter->index += count;
+    }
+
+    return count;
+}
+
+void vec_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    VecIter *vec_iter = (VecIter*)container_of(iter, VecIter, iter);
+
+    *lower = vec_iter->end - vec_iter->index;
+    *upper = *lower;
+}
+
+/* Table */
+// Create a table with a column for each of the given sizes. No memory is
+// allocated until rows are added.
+Table table_create(Allocator *allocator, const size_t *column_sizes, size_t column_count) {
+    assert(column_count <= TABLE_MAX_COLUMNS);
+
+    Table table = { allocator, column_count, { 0 }, { NULL }, 0, 0 };
+    for (size_t column = 0; column < column_count; column++) {
+        table.column_sizes[column] = column_sizes[column];
+    }
+
+    return table;
+}
+
+void table_destroy(Table *table) {
+    for (size_t column = 0; column < table->column_count; column++) {
+        if (NULL != table->columns[column]) {
+            table->allocator->free(table->allocator, table->columns[column]);
+            table->columns[column] = NULL;
+        }
+    }
+    table->count = 0;
+    table->capacity = 0;
+}
+
+// Make sure there is room for at least additional more rows, returning false if
+// the memory couldn't be allocated. All the new columns are allocated before any
+// are replaced, so a failure leaves the table as it was.
+bool table_reserve(Table *table, size_t additional) {
+    if (additional <= table->capacity - table->count) {
+        return true;
+    }
+
+    size_t new_capacity = table->capacity * 2;
+    if (new_capacity < table->count + additional) {
+        new_capacity = table->count + additional;
+    }
+
+    Allocator *allocator = table->allocator;
+    uint8_t *columns[TABLE_MAX_COLUMNS] = { NULL };
+    for (size_t column = 0; column < table->column_count; column++) {
+        size_t size = table->column_sizes[column];
+        if (new_capacity <= SIZE_MAX / size) {
+            columns[column] = allocator->alloc(allocator, size * new_capacity);
+        }
+
+        if (NULL == columns[column]) {
+            for (size_t allocated = 0; allocated < column; allocated++) {
+                allocator->free(allocator, columns[allocated]);
+            }
+            return false;
+        }
+    }
+
+    for (size_t column = 0; column < table->column_count; column++) {
+        if (NULL != table->columns[column]) {
+            memcpy(columns[column], table->columns[column], table->column_sizes[column] * table->count);
+            allocator->free(allocator, table->columns[column]);
+        }
+        table->columns[column] = columns[column];
+    }
+    table->capacity = new_capacity;
+
+    return true;
+}
+
+// Get the array of a column's elements, which has one element per row.
+void *table_column(const Table *table, size_t column) {
+    assert(column < table->column_count);
+
+    return table->columns[column];
+}
+
+// Write a record's fields into a row, where offsets gives the offset of each
+// column's field in the record.
+void table_scatter(Table *table, size_t row, const void *record, const size_t *offsets) {
+    assert(row < table->count);
+
+    const uint8_t *fields = (const uint8_t*)record;
+    for (size_t column = 0; column < table->column_count; column++) {
+        size_t size = table->column_sizes[column];
+        memcpy(&table->columns[column][row * size], &fields[offsets[column]], size);
+    }
+}
+
+// Read a row into a record's fields, the reverse of table_scatter.
+void table_gather(const Table *table, size_t row, void *record, const size_t *offsets) {
+    assert(row < table->count);
+
+    uint8_t *fields = (uint8_t*)record;
+    for (size_t column = 0; column < table->column_count; column++) {
+        size_t size = table->column_sizes[column];
+        memcpy(&fields[offsets[column]], &table->columns[column][row * size], size);
+    }
+}
+
+// Add a record as a new row, returning false if the memory couldn't be allocated.
+bool table_push(Table *table, const void *record, const size_t *offsets) {
+    if (!table_reserve(table, 1)) {
+        return false;
+    }
+
+    table->count++;
+    table_scatter(table, table->count - 1, record, offsets);
+
+    return true;
+}
+
+// Copy the given rows of one column into a contiguous array of values.
+void table_gather_column(const Table *table, size_t column, const size_t *rows, size_t count, void *values) {
+    assert(column < table->column_count);
+
+    size_t size = table->column_sizes[column];
+    uint8_t *results = (uint8_t*)values;
+    for (size_t index = 0; index < count; index++) {
+        assert(rows[index] < table->count);
+        memcpy(&results[index * size], &table->columns[column][rows[index] * size], size);
+    }
+}
+
+// Copy a contiguous array of values into the given rows of one column.
+void table_scatter_column(Table *table, size_t column, const size_t *rows, size_t count, const void *values) {
+    assert(column < table->column_count);
+
+    size_t size = table->column_sizes[column];
+    const uint8_t *inputs = (const uint8_t*)values;
+    for (size_t index = 0; index < count; index++) {
+        assert(rows[index] < table->count);
+        memcpy(&table->columns[column][rows[index] * size], &inputs[index * size], size);
+    }
+}
+
+// Create an iterator over slices of up to slice_length rows of the given
+// columns. The slices point into the table, so it mustn't grow while they are
+// in use.
+ColumnIter column_iter_create(const Table *table, const size_t *columns, size_t column_count, size_t slice_length) {
+    assert(column_count <= TABLE_MAX_COLUMNS);
+
+    ColumnIter column_iter = {
+        { column_iter_next, NULL, column_iter_size_hint },
+        table,
+        column_count,
+        { 0 },
+        slice_length > 0 ? slice_length : 1,
+        0,
+    };
+    for (size_t index = 0; index < column_count; index++) {
+        assert(columns[index] < table->column_count);
+        column_iter.columns[index] = columns[index];
+    }
+
+    return column_iter;
+}
+
+bool column_iter_next(Iter *iter, void *value) {
+    ColumnIter *column_iter = (ColumnIter*)container_of(iter, ColumnIter, iter);
+    const Table *table = column_iter->table;
+
+    if (column_iter->row >= table->count) {
+        return false;
+    }
+
+    ColumnSlice *slice = (ColumnSlice*)value;
+    slice->row = column_iter->row;
+    slice->count = table->count - column_iter->row;
+    if (slice->count > column_iter->slice_length) {
+        slice->count = column_iter->slice_length;
+    }
+
+    for (size_t index = 0; index < column_iter->column_count; index++) {
+        size_t column = column_iter->columns[index];
+        slice->columns[index] = &table->columns[column][column_iter->row * table->column_sizes[column]];
+    }
+
+    column_iter->row += slice->count;
+
+    return true;
+}
+
+// The number of slices left is known exactly.
+void column_iter_size_hint(Iter *iter, size_t *lower, size_t *upper) {
+    ColumnIter *column_iter = (ColumnIter*)container_of(iter, ColumnIter, iter);
+
+    size_t rows = 0;
+    if (column_iter->row < column_iter->table->count) {
+        rows = column_iter->table->count - column_iter->row;
+    }
+
+    *lower = (rows + column_iter->slice_length - 1) / column_iter->slice_length;
+    *upper = *lower;
+}
+
+/* Parallel Iterator */
+// A parallel iterator over the values from start up to end.
+ParIter par_iter_range(uint32_t start, uint32_t end) {
+    size_t length = start < end ? end - start : 0;
+
+    return (ParIter){ par_range_split, NULL, start, length, NULL, NULL, sizeof(uint32_t) };
+}
+
+// A parallel iterator over the elements of a Vec, which must not change while
+// the iterator is used.
+ParIter par_iter_vec(const Vec *vec) {
+    return (ParIter){ par_vec_split, vec, 0, vec->count, NULL, NULL, vec->element_size };
+}
+
+// Run a pipeline over each chunk, giving elements of element_size to the
+// reduction rather than the source's elements.
+void par_iter_pipeline(ParIter *par_iter, ParPipelineFn pipeline, void *context, size_t element_size) {
+    assert(element_size <= ITER_ITEM_SIZE);
+
+    par_iter->pipeline = pipeline;
+    par_iter->pipeline_context = context;
+    par_iter->element_size = element_size;
+}
+
+Iter *par_range_split(const ParIter *par_iter, size_t start, size_t end, void *storage) {
+    Range *range = (Range*)storage;
+    *range = range_create(par_iter->offset + start, par_iter->offset + end);
+
+    return &range->iter;
+}
+
+Iter *par_vec_split(const ParIter *par_iter, size_t start, size_t end, void *storage) {
+    VecIter *vec_iter = (VecIter*)storage;
+    *vec_iter = vec_iter_slice((const Vec*)par_iter->source, start, end);
+
+    return &vec_iter->iter;
+}
+
+// The state shared by the threads running a reduction.
+typedef struct ParJob {
+    const ParIter *par_iter;
+    const ParReduce *reduce;
+    size_t chunk_count;
+    // the next chunk for a thread to take.
+    atomic_size_t next_chunk;
+    // an accumulator for each chunk.
+    uint8_t (*accumulators)[ITER_ITEM_SIZE];
+} ParJob;
+
+// Take chunks until there are none left, reducing each into its accumulator.
+static void *par_job_run(void *arg) {
+    ParJob *job = (ParJob*)arg;
+    const ParIter *par_iter = job->par_iter;
+    const ParReduce *reduce = job->reduce;
+
+    _Alignas(max_align_t) uint8_t source_storage[ITER_ITEM_SIZE];
+    _Alignas(max_align_t) uint8_t pipeline_storage[PAR_PIPELINE_SIZE];
+    _Alignas(max_align_t) uint8_t batch[PAR_BATCH_LENGTH * ITER_ITEM_SIZE];
+
+    size_t batch_length = PAR_BATCH_LENGTH * ITER_ITEM_SIZE / par_iter->element_size;
+
+    while (true) {
+        size_t chunk = atomic_fetch_add_explicit(&job->next_chunk, 1, memory_order_relaxed);
+        if (chunk >= job->chunk_count) {
+            break;
+        }
+
+        size_t start = par_iter->length * chunk / job->chunk_count;
+        size_t end = par_iter->length * (chunk + 1) / job->chunk_count;
+
+        Iter *iter = par_iter->split(par_iter, start, end, source_storage);
+        if (NULL != par_iter->pipeline) {
+            iter = par_iter->pipeline(par_iter->pipeline_context, iter, pipeline_storage);
+        }
+
+        void *accumulator = job->accumulators[chunk];
+        reduce->identity(reduce->context, accumulator);
+
+        size_t count = 0;
+        do {
+            count = iter_next_batch(iter, batch, par_iter->element_size, batch_length);
+            reduce->fold(reduce->context, accumulator, batch, count);
+        } while (count == batch_length);
+    }
+
+    return NULL;
+}
+
+// Reduce the elements of a parallel iterator using up to the given number of
+// threads, including the calling thread, writing the result to result.
+// If a thread can't be started, the threads that did start take its share.
+void par_iter_reduce(const ParIter *par_iter, const ParReduce *reduce, size_t threads, void *result) {
+    assert(reduce->accumulator_size <= ITER_ITEM_SIZE);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > PAR_MAX_THREADS) {
+        threads = PAR_MAX_THREADS;
+    }
+
+    // no more chunks than elements, but always at least one, so that an
+    // empty source still reduces to the identity.
+    size_t chunk_count = threads * PAR_CHUNKS_PER_THREAD;
+    if (chunk_count > par_iter->length) {
+        chunk_count = par_iter->length > 0 ? par_iter->length : 1;
+    }
+
+    _Alignas(max_align_t) uint8_t accumulators[PAR_MAX_THREADS * PAR_CHUNKS_PER_THREAD][ITER_ITEM_SIZE];
+
+    ParJob job = { par_iter, reduce, chunk_count, 0, accumulators };
+
+    pthread_t workers[PAR_MAX_THREADS];
+    size_t started = 0;
+    for (size_t index = 1; index < threads; index++) {
+        if (0 != pthread_create(&workers[started], NULL, par_job_run, &job)) {
+            break;
+        }
+        started++;
+    }
+
+    par_job_run(&job);
+
+    for (size_t index = 0; index < started; index++) {
+        pthread_join(workers[index], NULL);
+    }
+
+    // merge the chunks in order.
+    memcpy(result, accumulators[0], reduce->accumulator_size);
+    for (size_t chunk = 1; chunk < chunk_count; chunk++) {
+        reduce->merge(reduce->context, result, accumulators[chunk]);
+    }
+}
+
+/* Parallel Iterator On A Scheduler */
+// A piece of a parallel iterator reduction. Pieces larger than the grain are
+// split in half, forking one half so that another worker can steal it.
+typedef struct ParTask {
+    Task task;
+    const ParIter *par_iter;
+    const ParReduce *reduce;
+    size_t grain;
+    size_t start;
+    size_t end;
+    _Alignas(max_align_t) uint8_t accumulator[ITER_ITEM_SIZE];
+} ParTask;
+
+static void par_task_run(SchedulerWorker *worker, Task *task) {
+    ParTask *par_task = (ParTask*)container_of(task, ParTask, task);
+    const ParIter *par_iter = par_task->par_iter;
+    const ParReduce *reduce = par_task->reduce;
+
+    if (par_task->end - par_task->start > par_task->grain) {
+        size_t middle = par_task->start + (par_task->end - par_task->start) / 2;
+        ParTask left = *par_task;
+        ParTask right = *par_task;
+        left.task = task_create(par_task_run);
+        left.end = middle;
+        right.task = task_create(par_task_run);
+        right.start = middle;
+
+        scheduler_fork(worker, &right.task);
+        par_task_run(worker, &left.task);
+        scheduler_join(worker, &right.task);
+
+        memcpy(par_task->accumulator, left.accumulator, reduce->accumulator_size);
+        reduce->merge(reduce->context, par_task->accumulator, right.accumulator);
+        return;
+    }
+
+    // the pipeline and batch buffer come from scratch memory.
+    size_t mark = scheduler_scratch_mark(worker);
+    Allocator *scratch = scheduler_scratch(worker);
+
+    size_t batch_length = PAR_BATCH_LENGTH;
+    uint8_t *source_storage = scratch->alloc(scratch, ITER_ITEM_SIZE);
+    uint8_t *pipeline_storage = scratch->alloc(scratch, PAR_PIPELINE_SIZE);
+    uint8_t *batch = scratch->alloc(scratch, batch_length * ITER_ITEM_SIZE);
+    assert(NULL != batch);
+
+    Iter *iter = par_iter->split(par_iter, par_task->start, par_task->end, source_storage);
+    if (NULL != par_iter->pipeline) {
+        iter = par_iter->pipeline(par_iter->pipeline_context, iter, pipeline_storage);
+    }
+
+    reduce->identity(reduce->context, par_task->accumulator);
+    size_t count = 0;
+    do {
+        count = iter_next_batch(iter, batch, par_iter->element_size, batch_length);
+        reduce->fold(reduce->context, par_task->accumulator, batch, count);
+    } while (count == batch_length);
+
+    scheduler_scratch_release(worker, mark);
+}
+
+// Reduce a parallel iterator on a scheduler, splitting it into pieces of no more
+// than grain elements. Each worker's scratch memory needs room for the pipeline
+// and a batch of elements, which is PAR_PIPELINE_SIZE plus
+// ITER_ITEM_SIZE * (PAR_BATCH_LENGTH + 1) bytes.
+void par_iter_reduce_scheduler(Scheduler *scheduler, const ParIter *par_iter, const ParReduce *reduce,
+                               size_t grain, void *result) {
+    assert(reduce->accumulator_size <= ITER_ITEM_SIZE);
+
+    ParTask root = {
+        task_create(par_task_run), par_iter, reduce, grain > 0 ? grain : 1, 0, par_iter->length, { 0 },
+    };
+    scheduler_run(scheduler, &root.task);
+
+    memcpy(result, root.accumulator, reduce->accumulator_size);
+}
+
+/* Work Deque */
+// The deque follows "Correct and Efficient Work-Stealing for Weak Memory
+// Models" by Le, Pop, Cohen and Zappa Nardelli, with a fixed size ring.
+void work_deque_init(WorkDeque *deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    for (size_t index = 0; index < WORK_DEQUE_LENGTH; index++) {
+        atomic_init(&deque->tasks[index], NULL);
+    }
+}
+
+// Push a task at the bottom, returning false if the deque is full. Only the
+// owner may push.
+bool work_deque_push(WorkDeque *deque, Task *task) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= WORK_DEQUE_LENGTH) {
+        return false;
+    }
+
+    atomic_store_explicit(&deque->tasks[bottom % WORK_DEQUE_LENGTH], task, memory_order_relaxed);
+    // release, so a thief that sees the new bottom also sees the task.
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+
+    return true;
+}
+
+// Take the most recently pushed task from the bottom, or NULL if there are none.
+// Only the owner may take.
+Task *work_deque_take(WorkDeque *deque) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // the deque was empty.
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Task *task = atomic_load_explicit(&deque->tasks[bottom % WORK_DEQUE_LENGTH], memory_order_relaxed);
+    if (top == bottom) {
+        // this is the last task, so race any thieves for it.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+// Steal the oldest task from the top, or NULL if there are none or another
+// thread got there first. Any thread may steal.
+Task *work_deque_steal(WorkDeque *deque) {
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    Task *task = atomic_load_explicit(&deque->tasks[top % WORK_DEQUE_LENGTH], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    return task;
+}
+
+/* Scheduler */
+Task task_create(TaskFn fn) {
+    return (Task){ fn, false };
+}
+
+static void *scheduler_worker_run(void *arg);
+
+// Create a scheduler with the given number of threads, including the thread that
+// will call scheduler_run. Each worker gets scratch_size bytes of scratch memory,
+// and looks for work spin_rounds times before parking when it is idle. Nothing is
+// allocated or started until scheduler_start.
+Scheduler scheduler_create(Allocator *allocator, size_t threads, size_t scratch_size, uint32_t spin_rounds) {
+    return (Scheduler){
+        allocator,
+        NULL,
+        NULL,
+        threads > 0 ? threads : 1,
+        scratch_size,
+        spin_rounds,
+        false,
+        PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+        0,
+    };
+}
+
+// Stop the worker threads, waiting for the first count of them to exit.
+static void scheduler_join_threads(Scheduler *scheduler, size_t count) {
+    pthread_mutex_lock(&scheduler->lock);
+    atomic_store(&scheduler->running, false);
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (size_t index = 1; index < count; index++) {
+        pthread_join(scheduler->workers[index].thread, NULL);
+    }
+}
+
+// Free the scratch memory of the first count workers, and then the workers.
+static void scheduler_free_workers(Scheduler *scheduler, size_t count) {
+    Allocator *allocator = scheduler->allocator;
+    for (size_t index = 0; index < count; index++) {
+        if (NULL != scheduler->workers[index].scratch.memory) {
+            allocator->free(allocator, scheduler->workers[index].scratch.memory);
+        }
+    }
+    allocator->free(allocator, scheduler->worker_memory);
+    scheduler->workers = NULL;
+    scheduler->worker_memory = NULL;
+}
+
+// Allocate the workers and start their threads. If any of that fails, whatever
+// was started is stopped and freed again, and false is returned.
+bool scheduler_start(Scheduler *scheduler) {
+    Allocator *allocator = scheduler->allocator;
+
+    size_t align = _Alignof(SchedulerWorker);
+    scheduler->worker_memory = allocator->alloc(allocator, sizeof(SchedulerWorker) * scheduler->worker_count + align - 1);
+    if (NULL == scheduler->worker_memory) {
+        return false;
+    }
+    scheduler->workers = (SchedulerWorker*)(((uintptr_t)scheduler->worker_memory + align - 1) & ~(uintptr_t)(align - 1));
+
+    for (size_t index = 0; index < scheduler->worker_count; index++) {
+        SchedulerWorker *worker = &scheduler->workers[index];
+        work_deque_init(&worker->deque);
+        worker->scheduler = scheduler;
+        worker->index = index;
+        worker->random = (uint32_t)(index * 2654435761u) | 1;
+
+        uint8_t *memory = NULL;
+        if (0 < scheduler->scratch_size) {
+            memory = allocator->alloc(allocator, scheduler->scratch_size);
+            if (NULL == memory) {
+                scheduler_free_workers(scheduler, index);
+                return false;
+            }
+        }
+        worker->scratch = bump_allocator_create(scheduler->scratch_size, memory);
+    }
+
+    atomic_store(&scheduler->running, true);
+
+    // the first worker is the thread that calls scheduler_run. The other workers
+    // read worker_count, so it stays the same even if a thread can't be started.
+    for (size_t index = 1; index < scheduler->worker_count; index++) {
+        SchedulerWorker *worker = &scheduler->workers[index];
+        if (0 != pthread_create(&worker->thread, NULL, scheduler_worker_run, worker)) {
+            scheduler_join_threads(scheduler, index);
+            scheduler_free_workers(scheduler, scheduler->worker_count);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Stop the worker threads and free the workers. No task may be running.
+void scheduler_stop(Scheduler *scheduler) {
+    if (NULL == scheduler->workers) {
+        return;
+    }
+
+    scheduler_join_threads(scheduler, scheduler->worker_count);
+    scheduler_free_workers(scheduler, scheduler->worker_count);
+}
+
+// Run a task, and everything it forks, returning when it is done. The calling
+// thread works as the first worker. Only one thread may call this at a time.
+void scheduler_run(Scheduler *scheduler, Task *task) {
+    SchedulerWorker *worker = &scheduler->workers[0];
+
+    scheduler_fork(worker, task);
+    scheduler_join(worker, task);
+
+    bump_allocator_free_all(&worker->scratch.allocator);
+}
+
+// Run a task, marking it done. The task may be freed by whoever joins it as soon
+// as it is marked, so it can't be touched after that.
+static void scheduler_execute(SchedulerWorker *worker, Task *task) {
+    task->fn(worker, task);
+    atomic_store_explicit(&task->done, true, memory_order_release);
+}
+
+// Look for a task to run- first in our own deque, and then by stealing from
+// the other workers, starting with a random one.
+static Task *scheduler_find_task(SchedulerWorker *worker) {
+    Task *task = work_deque_take(&worker->deque);
+    if (NULL != task) {
+        return task;
+    }
+
+    Scheduler *scheduler = worker->scheduler;
+    size_t count = scheduler->worker_count;
+
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= worker->random << 5;
+    size_t first = worker->random % count;
+
+    for (size_t offset = 0; offset < count; offset++) {
+        size_t victim = (first + offset) % count;
+        if (victim != worker->index) {
+            task = work_deque_steal(&scheduler->workers[victim].deque);
+            if (NULL != task) {
+                return task;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Check whether any worker has a task waiting.
+static bool scheduler_has_work(Scheduler *scheduler) {
+    for (size_t index = 0; index < scheduler->worker_count; index++) {
+        WorkDeque *deque = &scheduler->workers[index].deque;
+        if (atomic_load(&deque->top) < atomic_load(&deque->bottom)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Make a task available to be run, by this worker later or by a thief, waking a
+// parked worker if there is one. If the deque is full, the task is run now.
+void scheduler_fork(SchedulerWorker *worker, Task *task) {
+    Scheduler *scheduler = worker->scheduler;
+
+    if (!work_deque_push(&worker->deque, task)) {
+        scheduler_execute(worker, task);
+        return;
+    }
+
+    // pairs with the sleeping count a worker sets before checking for work one
+    // last time, so either it sees this task or we see that it is parking.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&scheduler->sleeping) > 0) {
+        pthread_mutex_lock(&scheduler->lock);
+        pthread_cond_signal(&scheduler->wake);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+// Wait for a forked task to finish, running other tasks in the meantime.
+void scheduler_join(SchedulerWorker *worker, Task *task) {
+    uint32_t rounds = 0;
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        Task *other = scheduler_find_task(worker);
+        if (NULL != other) {
+            scheduler_execute(worker, other);
+            rounds = 0;
+        } else if (++rounds >= worker->scheduler->spin_rounds) {
+            // the task is running on another worker, so give it our CPU.
+            sched_yield();
+        }
+    }
+}
+
+// Scratch memory for a task running on this worker. It is reset once the worker
+// finishes the task it started from idle, so it can't be kept after that.
+// The bump allocator doesn't align, so allocating multiples of max_align_t
+// keeps every allocation aligned.
+Allocator *scheduler_scratch(SchedulerWorker *worker) {
+    return &worker->scratch.allocator;
+}
+
+// Get a mark for the current position in the worker's scratch memory, so that a
+// task can give back what it used with scheduler_scratch_release before it
+// returns. Tasks run inside the task from scheduler_join finish before it does,
+// so releases happen in the reverse order of their marks.
+size_t scheduler_scratch_mark(SchedulerWorker *worker) {
+    return worker->scratch.count;
+}
+
+void scheduler_scratch_release(SchedulerWorker *worker, size_t mark) {
+    assert(mark <= worker->scratch.count);
+
+    worker->scratch.count = mark;
+}
+
+static void *scheduler_worker_run(void *arg) {
+    SchedulerWorker *worker = (SchedulerWorker*)arg;
+    Scheduler *scheduler = worker->scheduler;
+
+    uint32_t rounds = 0;
+    while (atomic_load(&scheduler->running)) {
+        Task *task = scheduler_find_task(worker);
+        if (NULL != task) {
+            scheduler_execute(worker, task);
+            bump_allocator_free_all(&worker->scratch.allocator);
+            rounds = 0;
+            continue;
+        }
+
+        if (++rounds < scheduler->spin_rounds) {
+            sched_yield();
+            continue;
+        }
+
+        // park until a task is forked, checking for work once more after
+        // saying we are parking, so a fork can't slip past unseen.
+        pthread_mutex_lock(&scheduler->lock);
+        atomic_fetch_add(&scheduler->sleeping, 1);
+        if (atomic_load(&scheduler->running) && !scheduler_has_work(scheduler)) {
+            pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+        }
+        atomic_fetch_sub(&scheduler->sleeping, 1);
+        pthread_mutex_unlock(&scheduler->lock);
+        rounds = 0;
+    }
+
+    return NULL;
+}
+
+/* Heap Allocator */
+HeapAllocator heap_allocator_create(void) {
+    return (HeapAllocator) { { heap_allocator_alloc, heap_allocator_free, heap_allocator_realloc, heap_allocator_good_size, } };
+}
+
+void *heap_allocator_alloc(Allocator *allocator, size_t size) {
+    return malloc(size);
+}
+
+void heap_allocator_free(Allocator *allocator, void *ptr) {
+    free(ptr);
+}
+
+void *heap_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    return realloc(old_ptr, new_size);
+}
+
+size_t heap_allocator_good_size(Allocator *allocator, size_t size) {
+    const size_t word = sizeof(size_t);
+
+    size_t chunk = (size + word + 2 * word - 1) & ~(2 * word - 1);
+    if (chunk < 4 * word) {
+        chunk = 4 * word;
+    }
+
+    return chunk - word;
+}
+
+/* Bump Allocator */
+BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory) {
+    Allocator allocator = (Allocator){ bump_allocator_alloc, bump_allocator_free, bump_allocator_realloc, bump_allocator_good_size };
+    return (BumpAllocator){ allocator, memory, 0, capacity };
+}
+
+void *bump_allocator_alloc(Allocator *allocator, size_t size) {
+    BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
+
+    uint8_t *ptr = NULL;
+    if (size <= (bump_allocator->length - bump_allocator->count)) {
+        ptr = &bump_allocator->memory[bump_allocator->count];
+        bump_allocator->count += size;
+    }
+
+    return ptr;
+}
+
+void bump_allocator_free(Allocator *allocator, void *ptr) {
+    // the bump allocator doesn't free anything
+    (void)allocator;
+    (void)ptr;
+}
+
+void *bump_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size) {
+    // just allocate new memory, there is no need to clean up the old pointer.
+    return bump_allocator_alloc(allocator, size);
+}
+
+size_t bump_allocator_good_size(Allocator *allocator, size_t size) {
+    (void)allocator;
+    return size;
+}
+
+// Free the whole allocation at once.
+void bump_allocator_free_all(Allocator *allocator) {
+    BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
+    bump_allocator->count = 0;
+}
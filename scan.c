@@ -15,6 +15,34 @@
 #endif
 
 
+// The Allocator trait, along with the heap and bump allocators, copied from alloc.c so
+// that this file stays self contained. See alloc.c for the details.
+typedef struct Allocator Allocator;
+
+typedef void* (*AllocatorAlloc)(Allocator *allocator, size_t size);
+typedef void (*AllocatorFree)(Allocator *allocator, void *ptr);
+typedef void* (*AllocatorRealloc)(Allocator *allocator, void *old_ptr, size_t new_size);
+typedef size_t (*AllocatorGoodSize)(Allocator *allocator, size_t size);
+
+typedef struct Allocator {
+    AllocatorAlloc alloc;
+    AllocatorFree free;
+    AllocatorRealloc realloc;
+    AllocatorGoodSize good_size;
+} Allocator;
+
+typedef struct HeapAllocator {
+    Allocator allocator;
+} HeapAllocator;
+
+typedef struct BumpAllocator {
+    Allocator allocator;
+    uint8_t *memory;
+    size_t count;
+    size_t length;
+} BumpAllocator;
+
+
 // Forward declare the scan type so we can define the function typedefs below.
 typedef struct Scan Scan;
 
@@ -49,6 +77,8 @@ typedef struct Sum {
 // then naively concatenating strings.
 typedef struct StringBuilder {
     Scan scan;
+    // the allocator the strings array comes from.
+    Allocator *allocator;
     // strings is the array of strings provided to the builder.
     char **strings;
     // count is the current number of strings collected.
@@ -57,13 +87,28 @@ typedef struct StringBuilder {
     uint32_t length;
 } StringBuilder;
 
+// HeapAllocator functions
+HeapAllocator heap_allocator_create(void);
+void *heap_allocator_alloc(Allocator *allocator, size_t size);
+void heap_allocator_free(Allocator *allocator, void *ptr);
+void *heap_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size);
+size_t heap_allocator_good_size(Allocator *allocator, size_t size);
+
+// BumpAllocator functions
+BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory);
+void *bump_allocator_alloc(Allocator *allocator, size_t size);
+void bump_allocator_free(Allocator *allocator, void *ptr);
+void *bump_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size);
+size_t bump_allocator_good_size(Allocator *allocator, size_t size);
+void bump_allocator_free_all(Allocator *allocator);
+
 // Sum functions
 Sum sum_create(void);
 void sum_return(Scan *scan, void *result);
 void sum_append(Scan *scan, void *value);
 
 // StringBuilder functions
-StringBuilder string_builder_create(uint32_t capacity);
+StringBuilder string_builder_create(Allocator *allocator, uint32_t capacity);
 void string_builder_destroy(StringBuilder *builder);
 void string_builder_return(Scan *scan, void *result);
 void string_builder_append(Scan *scan, void *value);
@@ -96,7 +141,13 @@ int main(int argc, char *argv[]) {
     {
         // create a string builder with a small capacity, so we have
         // to realloc (see string_builder_append).
-        StringBuilder string_builder = string_builder_create(2);
+        HeapAllocator heap_allocator = heap_allocator_create();
+        StringBuilder string_builder = string_builder_create(&heap_allocator.allocator, 2);
+
+        // the capacity includes the rounding the heap does.
+        size_t good_size = heap_allocator.allocator.good_size(&heap_allocator.allocator, sizeof(char*) * 2);
+        assert(string_builder.length == good_size / sizeof(char*));
+        assert(string_builder.length >= 2);
 
         // the StringBuilder is keeping these pointers internally, so
         // be sure to keep them allocated if they are not string literals...
@@ -116,6 +167,35 @@ int main(int argc, char *argv[]) {
         // allocated pointer.
         string_builder_destroy(&string_builder);
     }
+
+    // Build strings in a bump allocator, freeing them all at once as a request would.
+    printf("\nStringBuilder in a bump allocator test\n");
+    {
+        uint8_t memory[1024];
+        BumpAllocator bump_allocator = bump_allocator_create(sizeof(memory), memory);
+
+        for (int request = 0; request < 3; request++) {
+            StringBuilder string_builder = string_builder_create(&bump_allocator.allocator, 1);
+            assert(NULL != string_builder.strings);
+
+            string_builder.scan.append(&string_builder.scan, "one ");
+            string_builder.scan.append(&string_builder.scan, "two ");
+            string_builder.scan.append(&string_builder.scan, "three");
+
+            // the strings array lives in the bump allocator's memory.
+            assert((uint8_t*)string_builder.strings >= memory);
+            assert((uint8_t*)string_builder.strings < memory + sizeof(memory));
+
+            char result_string[64];
+            string_builder.scan.ret(&string_builder.scan, result_string);
+            assert(strcmp("one two three", result_string) == 0);
+
+            // no need to destroy the builder- the whole request's memory goes at once.
+            bump_allocator_free_all(&bump_allocator.allocator);
+            assert(0 == bump_allocator.count);
+        }
+        printf("StringBuilder in a bump allocator test complete\n");
+    }
 }
 
 // Create a Sum scan
@@ -139,12 +219,16 @@ void sum_append(Scan *scan, void *value) {
     sum->sum += *addend;
 }
 
-// Create a StringBuilder scan using the given initial capacity.
-StringBuilder string_builder_create(uint32_t capacity) {
-    char **strings = calloc(sizeof(char*), capacity);
+// Create a StringBuilder scan using the given initial capacity, with its memory coming
+// from the given allocator.
+StringBuilder string_builder_create(Allocator *allocator, uint32_t capacity) {
+    // use all the room the allocator would give us anyway.
+    capacity = allocator->good_size(allocator, sizeof(char*) * capacity) / sizeof(char*);
+    char **strings = allocator->alloc(allocator, sizeof(char*) * capacity);
 
     return (StringBuilder){
         { string_builder_return, string_builder_append },
+        allocator,
         strings,
         0,
         capacity,
@@ -154,7 +238,7 @@ StringBuilder string_builder_create(uint32_t capacity) {
 // Clean up the string builders string array.
 void string_builder_destroy(StringBuilder *builder) {
     if (NULL != builder->strings) {
-        free(builder->strings);
+        builder->allocator->free(builder->allocator, builder->strings);
         builder->strings = NULL;
     }
 }
@@ -186,12 +270,25 @@ void string_builder_append(Scan *scan, void *value) {
 
     char *string = (char*)value;
 
-    // if we have run out of capacity, just realloc with a larger array.
+    // if we have run out of capacity, move to a larger array.
     // This could be done better, or with a stretchy buffer, but this is
     // simpler as an example.
+    // We copy the strings over ourselves rather then using realloc, as
+    // allocators like the bump allocator don't know how large the old
+    // array was, and so can't copy it.
     if (builder->count == builder->length) {
-        uint32_t new_length = builder->length * 2;
-        builder->strings = realloc(builder->strings, new_length);
+        uint32_t new_length = builder->length == 0 ? 1 : builder->length * 2;
+        Allocator *allocator = builder->allocator;
+
+        // grow into any rounding the allocator does, which saves a later move.
+        new_length = allocator->good_size(allocator, sizeof(char*) * new_length) / sizeof(char*);
+
+        char **strings = allocator->alloc(allocator, sizeof(char*) * new_length);
+        // NOTE should check for a NULL result.
+        memcpy(strings, builder->strings, sizeof(char*) * builder->count);
+        allocator->free(allocator, builder->strings);
+
+        builder->strings = strings;
         builder->length = new_length;
     }
 
@@ -199,3 +296,70 @@ void string_builder_append(Scan *scan, void *value) {
     builder->count++;
 }
 
+/* Heap Allocator */
+HeapAllocator heap_allocator_create(void) {
+    return (HeapAllocator) { { heap_allocator_alloc, heap_allocator_free, heap_allocator_realloc, heap_allocator_good_size, } };
+}
+
+void *heap_allocator_alloc(Allocator *allocator, size_t size) {
+    return malloc(size);
+}
+
+void heap_allocator_free(Allocator *allocator, void *ptr) {
+    free(ptr);
+}
+
+void *heap_allocator_realloc(Allocator *allocator, void *old_ptr, size_t new_size) {
+    return realloc(old_ptr, new_size);
+}
+
+size_t heap_allocator_good_size(Allocator *allocator, size_t size) {
+    const size_t word = sizeof(size_t);
+
+    size_t chunk = (size + word + 2 * word - 1) & ~(2 * word - 1);
+    if (chunk < 4 * word) {
+        chunk = 4 * word;
+    }
+
+    return chunk - word;
+}
+
+/* Bump Allocator */
+BumpAllocator bump_allocator_create(size_t capacity, uint8_t *memory) {
+    Allocator allocator = (Allocator){ bump_allocator_alloc, bump_allocator_free, bump_allocator_realloc, bump_allocator_good_size };
+    return (BumpAllocator){ allocator, memory, 0, capacity };
+}
+
+void *bump_allocator_alloc(Allocator *allocator, size_t size) {
+    BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
+
+    uint8_t *ptr = NULL;
+    if (size <= (bump_allocator->length - bump_allocator->count)) {
+        ptr = &bump_allocator->memory[bump_allocator->count];
+        bump_allocator->count += size;
+    }
+
+    return ptr;
+}
+
+void bump_allocator_free(Allocator *allocator, void *ptr) {
+    // the bump allocator doesn't free anything
+    (void)allocator;
+    (void)ptr;
+}
+
+void *bump_allocator_realloc(Allocator *allocator, void *old_ptr, size_t size) {
+    // just allocate new memory, there is no need to clean up the old pointer.
+    return bump_allocator_alloc(allocator, size);
+}
+
+size_t bump_allocator_good_size(Allocator *allocator, size_t size) {
+    (void)allocator;
+    return size;
+}
+
+// Free the whole allocation at once.
+void bump_allocator_free_all(Allocator *allocator) {
+    BumpAllocator *bump_allocator = (BumpAllocator*)container_of(allocator, BumpAllocator, allocator);
+    bump_allocator->count = 0;
+}
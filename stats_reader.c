@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// This is a small tool for watching the allocator statistics that a process publishes
+// with a StatsRegion (see alloc.c). It maps the statistics file read-only and prints
+// the counters, so the process being watched doesn't have to do anything for us.
+//
+// Usage: stats_reader <path> [interval_ms]
+// With an interval, the counters are printed again every interval_ms milliseconds.
+
+// These definitions are copied from alloc.c, and must match the layout written there.
+#define STATS_MAGIC 0x53544154u
+#define STATS_VERSION 1
+#define STATS_NAME_LENGTH 32
+
+typedef struct StatsSlot {
+    char name[STATS_NAME_LENGTH];
+    atomic_uint_least64_t alloc_calls;
+    atomic_uint_least64_t free_calls;
+    atomic_uint_least64_t realloc_calls;
+    atomic_uint_least64_t bytes_in_use;
+    atomic_uint_least64_t peak_bytes;
+    atomic_uint_least64_t arena_count;
+    atomic_uint_least64_t arena_length;
+    uint64_t reserved;
+} StatsSlot;
+
+typedef struct StatsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    atomic_uint used_slots;
+    uint64_t pid;
+} StatsHeader;
+
+
+void stats_print(const StatsHeader *header);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path> [interval_ms]\n", argv[0]);
+        return 1;
+    }
+
+    long interval_ms = 0;
+    if (argc > 2) {
+        interval_ms = strtol(argv[2], NULL, 10);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    struct stat file_stat;
+    if ((0 != fstat(fd, &file_stat)) || ((size_t)file_stat.st_size < sizeof(StatsHeader))) {
+        fprintf(stderr, "%s is not a statistics file\n", argv[1]);
+        close(fd);
+        return 1;
+    }
+
+    const StatsHeader *header = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == header) {
+        perror("mmap");
+        return 1;
+    }
+
+    // check the file is what we think it is before trusting the slot count.
+    size_t length = sizeof(StatsHeader) + sizeof(StatsSlot) * (size_t)header->num_slots;
+    if ((STATS_MAGIC != header->magic) || (STATS_VERSION != header->version) ||
+        (length > (size_t)file_stat.st_size)) {
+        fprintf(stderr, "%s is not a statistics file\n", argv[1]);
+        return 1;
+    }
+
+    stats_print(header);
+    while (interval_ms > 0) {
+        usleep(interval_ms * 1000);
+        stats_print(header);
+    }
+
+    munmap((void*)header, file_stat.st_size);
+
+    return 0;
+}
+
+// Print one line per slot in use.
+void stats_print(const StatsHeader *header) {
+    const StatsSlot *slots = (const StatsSlot*)(header + 1);
+
+    unsigned int used_slots = atomic_load_explicit(&header->used_slots, memory_order_acquire);
+    if (used_slots > header->num_slots) {
+        used_slots = header->num_slots;
+    }
+
+    printf("pid %llu\n", (unsigned long long)header->pid);
+    printf("%-32s %12s %12s %12s %14s %14s %14s %14s\n",
+           "name", "allocs", "frees", "reallocs", "in use", "peak", "arena count", "arena length");
+
+    for (unsigned int index = 0; index < used_slots; index++) {
+        const StatsSlot *slot = &slots[index];
+        printf("%-32.*s %12llu %12llu %12llu %14llu %14llu %14llu %14llu\n",
+               STATS_NAME_LENGTH, slot->name,
+               (unsigned long long)atomic_load_explicit(&slot->alloc_calls, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&slot->free_calls, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&slot->realloc_calls, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&slot->bytes_in_use, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&slot->peak_bytes, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&slot->arena_count, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&slot->arena_length, memory_order_relaxed));
+    }
+
+    fflush(stdout);
+}